@@ -0,0 +1,148 @@
+#!/bin/sh
+# Run a set of queries over a pkglist a few times, summarize each metric
+# (median and variance), and optionally compare the results against
+# a baseline produced earlier by this very script.  Exits with status 1
+# if any metric of any benchmark regresses significantly.
+#
+# Usage: bench.sh [-n RUNS] [-o OUT.json] [-c BASE.json] [-t PCT] [-z Z]
+#		  [-e NAME=VAR=VALUE...] PKGLIST...
+#
+# Each -e option adds a variant of the environment under which every
+# benchmark is run, its results being named BENCH@NAME.  This is mostly
+# for GLIBC_TUNABLES, to run the benchmarks at every ISA level which
+# glibc can dispatch its string functions to, see bench-levels in the
+# Makefile.  An empty VAR=VALUE stands for the unmodified environment.
+#
+# A regression is reported only if the median gets worse by more than PCT
+# percent *and* the difference exceeds Z standard errors, the latter being
+# estimated from the variance of both sets of runs.  The first condition
+# filters out tiny changes that are statistically significant but do not
+# matter; the second filters out noise on a busy machine.
+
+set -efu
+
+PROG=${PROG:-./pkglist-query}
+# The options passed to every query, e.g. BENCH_OPTS=--huge-pages.
+OPTS=${BENCH_OPTS:-}
+TIME=${TIME:-/usr/bin/time}
+runs=5 out= base= pct=5 z=3 variants=
+while getopts n:o:c:t:z:e: opt; do
+	case $opt in
+		n) runs=$OPTARG ;;
+		o) out=$OPTARG ;;
+		c) base=$OPTARG ;;
+		t) pct=$OPTARG ;;
+		z) z=$OPTARG ;;
+		e) variants="$variants$OPTARG
+" ;;
+		*) exit 2 ;;
+	esac
+done
+shift $((OPTIND-1))
+if [ $# -lt 1 ]; then
+	echo >&2 "Usage: bench.sh [-n RUNS] [-o OUT.json] [-c BASE.json] [-t PCT] [-z Z] [-e NAME=VAR=VALUE...] PKGLIST..."
+	exit 2
+fi
+
+# The benchmarks, one per line: name, tab, query format.
+# The queries are the same as in the check target of the Makefile.
+NVRA='%{NAME}-%{VERSION}-%{RELEASE}.%{ARCH}'
+BENCHMARKS="\
+nvra	$NVRA\n
+files	[%{FILENAMES}\t%{NAME}\t$NVRA\n]
+provides	[%{PROVIDENAME}\t%{PROVIDENAME}\t$NVRA\n]"
+BENCHMARKS=${BENCH_QUERIES:-$BENCHMARKS}
+
+bytes=$(cat -- "$@" |wc -c)
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+# Each run appends "name wall_s mbps rss_kb" to the raw file.
+printf '%s\n' "$BENCHMARKS" |
+while IFS='	' read -r name fmt; do
+	[ -n "$name" ] || continue
+	IFS='
+'
+	for v in ${variants:-=}; do
+		IFS=' 	
+'
+		vname=${v%%=*} venv=${v#*=}
+		# Warm up the page cache.
+		env $venv "$PROG" $OPTS "$fmt" "$@" >/dev/null
+		i=0
+		while [ $i -lt $runs ]; do
+			env $venv "$TIME" -f '%e %M' -o "$tmp/time" "$PROG" $OPTS "$fmt" "$@" >/dev/null
+			read -r wall rss <"$tmp/time"
+			echo "$name${vname:+@$vname} $wall $rss" |
+			awk -v bytes=$bytes '{
+				mbps = $2 > 0 ? bytes / $2 / 1e6 : 0
+				printf "%s %s %.3f %s\n", $1, $2, mbps, $3 }'
+			i=$((i+1))
+		done
+	done
+done >"$tmp/raw"
+
+# Summarize the runs in JSON, one result per line, which keeps the
+# format easy to parse back with awk.
+awk -v input="$*" -v bytes=$bytes -v runs=$runs '
+	function add(b, m, v) {
+		k = b SUBSEP m
+		if (!(k in n)) keys[++nk] = k
+		vals[k, ++n[k]] = v
+	}
+	{ add($1, "wall_s", $2); add($1, "mbps", $3); add($1, "rss_kb", $4) }
+	END {
+		printf "{\n  \"input\": \"%s\",\n  \"input_bytes\": %d,\n  \"runs\": %d,\n  \"results\": [\n", input, bytes, runs
+		for (i = 1; i <= nk; i++) {
+			k = keys[i]; cnt = n[k]
+			# Insertion sort for the median.
+			for (j = 1; j <= cnt; j++) a[j] = vals[k, j]
+			for (j = 2; j <= cnt; j++)
+				for (l = j; l > 1 && a[l-1] > a[l]; l--) {
+					t = a[l]; a[l] = a[l-1]; a[l-1] = t
+				}
+			med = cnt % 2 ? a[(cnt+1)/2] : (a[cnt/2] + a[cnt/2+1]) / 2
+			sum = 0
+			for (j = 1; j <= cnt; j++) sum += a[j]
+			mean = sum / cnt; var = 0
+			for (j = 1; j <= cnt; j++) var += (a[j] - mean) ^ 2
+			var = cnt > 1 ? var / (cnt - 1) : 0
+			split(k, bm, SUBSEP)
+			printf "    { \"bench\": \"%s\", \"metric\": \"%s\", \"median\": %.6g, \"var\": %.6g, \"n\": %d }%s\n", bm[1], bm[2], med, var, cnt, i < nk ? "," : ""
+		}
+		printf "  ]\n}\n"
+	}' "$tmp/raw" >"$tmp/json"
+
+if [ -n "$out" ]; then
+	cp "$tmp/json" "$out"
+elif [ -z "$base" ]; then
+	cat "$tmp/json"
+fi
+
+[ -n "$base" ] || exit 0
+
+# Compare against the baseline.  Lower is better for everything
+# but throughput; the change is printed positive when it gets worse.
+awk -v pct=$pct -v z=$z '
+	BEGIN { printf "%-10s %-7s %12s %12s %8s\n", "bench", "metric", "base", "new", "worse" }
+	function parse(line) {
+		match(line, /"bench": "[^"]*"/);  B = substr(line, RSTART+10, RLENGTH-11)
+		match(line, /"metric": "[^"]*"/); M = substr(line, RSTART+11, RLENGTH-12)
+		match(line, /"median": [^,]*/);   MED = substr(line, RSTART+10, RLENGTH-10) + 0
+		match(line, /"var": [^,]*/);      VAR = substr(line, RSTART+7, RLENGTH-7) + 0
+		match(line, /"n": [0-9]*/);       N = substr(line, RSTART+5, RLENGTH-5) + 0
+	}
+	!/"bench"/ { next }
+	FNR == NR { parse($0); bmed[B, M] = MED; bvar[B, M] = VAR; bn[B, M] = N; next }
+	{
+		parse($0)
+		if (!((B, M) in bmed)) next
+		old = bmed[B, M]
+		d = M == "mbps" ? old - MED : MED - old
+		se = sqrt(bvar[B, M] / bn[B, M] + VAR / N)
+		rel = old > 0 ? 100 * d / old : 0
+		bad = rel > pct && d > z * se
+		printf "%-10s %-7s %12.6g %12.6g %+7.1f%%%s\n", B, M, old, MED, rel, bad ? "  REGRESSION" : ""
+		if (bad) fail = 1
+	}
+	END { exit fail }' "$base" "$tmp/json"
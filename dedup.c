@@ -0,0 +1,197 @@
+// Copyright (c) 2017 Alexey Tourbin
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <stdlib.h>
+#include <string.h>
+#include "dedup.h"
+
+// The blobs are told apart by a 128-bit hash and the size, which makes
+// a false match much less likely than a memory error.
+struct slot {
+    uint64_t h1, h2;
+    uint64_t size; // 0 if the slot is empty
+    uint64_t id;
+};
+
+struct cached {
+    char *str;
+    size_t len;
+};
+
+struct dedup {
+    // The feeder's part.
+    size_t nslots, nkeys;
+    struct slot *slots;
+    uint64_t nblobs, ndup, dupBytes;
+    // The sink's part.
+    struct cached *cache;
+    size_t ncached, alloc;
+    size_t budget, cachedBytes, reusedBytes;
+    bool full; // set by the sink, checked by the feeder
+};
+
+struct dedup *dedupNew(size_t budget)
+{
+    struct dedup *d = calloc(1, sizeof *d);
+    if (!d)
+	return NULL;
+    d->nslots = 1 << 12;
+    d->slots = calloc(d->nslots, sizeof *d->slots);
+    if (!d->slots) {
+	free(d);
+	return NULL;
+    }
+    d->budget = budget;
+    return d;
+}
+
+void dedupFree(struct dedup *d)
+{
+    if (!d)
+	return;
+    for (size_t i = 0; i < d->ncached; i++)
+	free(d->cache[i].str);
+    free(d->cache);
+    free(d->slots);
+    free(d);
+}
+
+static inline uint64_t rotl(uint64_t x, int r)
+{
+    return x << r | x >> (64 - r);
+}
+
+// Two multiply-rotate lanes over 8-byte words, which runs at memory speed
+// in the decoding thread.  Not meant to withstand crafted collisions.
+void dedupHash(const void *blob, size_t size, uint64_t h[2])
+{
+    const unsigned char *p = blob;
+    uint64_t h1 = 0x9e3779b97f4a7c15ULL ^ size, h2 = 0xc2b2ae3d27d4eb4fULL + size;
+    size_t n = size / 8;
+    for (size_t i = 0; i < n; i++, p += 8) {
+	uint64_t w;
+	memcpy(&w, p, 8);
+	h1 = rotl(h1 ^ w * 0x87c37b91114253d5ULL, 31) * 0x9e3779b97f4a7c15ULL;
+	h2 = rotl(h2 + w * 0x4cf5ad432745937fULL, 29) * 0xc2b2ae3d27d4eb4fULL;
+    }
+    uint64_t w = 0;
+    memcpy(&w, p, size % 8);
+    h1 ^= w, h2 += w;
+    h1 ^= h1 >> 33, h1 *= 0xff51afd7ed558ccdULL, h1 ^= h1 >> 33;
+    h2 ^= h2 >> 29, h2 *= 0xc4ceb9fe1a85ec53ULL, h2 ^= h2 >> 32;
+    h[0] = h1, h[1] = h2 ^ h1;
+}
+
+static bool grow(struct dedup *d)
+{
+    size_t nslots = 2 * d->nslots;
+    struct slot *slots = calloc(nslots, sizeof *slots);
+    if (!slots)
+	return false;
+    for (size_t i = 0; i < d->nslots; i++) {
+	struct slot *s = &d->slots[i];
+	if (!s->size)
+	    continue;
+	size_t j = s->h1 & (nslots - 1);
+	while (slots[j].size)
+	    j = (j + 1) & (nslots - 1);
+	slots[j] = *s;
+    }
+    free(d->slots);
+    d->slots = slots, d->nslots = nslots;
+    return true;
+}
+
+uint64_t dedupLookup(struct dedup *d, const void *blob, size_t size, bool *dup)
+{
+    uint64_t h[2];
+    dedupHash(blob, size, h);
+    uint64_t h1 = h[0], h2 = h[1];
+    d->nblobs++;
+    size_t j = h1 & (d->nslots - 1);
+    for (struct slot *s; (s = &d->slots[j])->size; j = (j + 1) & (d->nslots - 1))
+	if (s->h1 == h1 && s->h2 == h2 && s->size == size) {
+	    d->ndup++;
+	    d->dupBytes += size;
+	    *dup = true;
+	    return s->id;
+	}
+    *dup = false;
+    if (__atomic_load_n(&d->full, __ATOMIC_RELAXED) || size == 0)
+	return DEDUP_NOID;
+    // A failure to grow the table only means no more blobs are taken in.
+    if (d->nkeys >= d->nslots / 2 && !grow(d))
+	return DEDUP_NOID;
+    j = h1 & (d->nslots - 1);
+    while (d->slots[j].size)
+	j = (j + 1) & (d->nslots - 1);
+    d->slots[j] = (struct slot) { h1, h2, size, d->nkeys };
+    return d->nkeys++;
+}
+
+bool dedupStore(struct dedup *d, uint64_t id, const char *str, size_t len)
+{
+    if (id == DEDUP_NOID)
+	return true;
+    if (d->ncached == d->alloc) {
+	size_t alloc = d->alloc ? 2 * d->alloc : 1024;
+	struct cached *cache = realloc(d->cache, alloc * sizeof *cache);
+	if (!cache)
+	    return false;
+	d->cache = cache, d->alloc = alloc;
+    }
+    char *copy = malloc(len + 1);
+    if (!copy)
+	return false;
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    // The ids are assigned by the feeder in the same order.
+    d->cache[id] = (struct cached) { copy, len };
+    d->ncached = id + 1;
+    d->cachedBytes += len + 1;
+    if (d->cachedBytes > d->budget)
+	__atomic_store_n(&d->full, true, __ATOMIC_RELAXED);
+    return true;
+}
+
+const char *dedupFetch(struct dedup *d, uint64_t id, size_t *lenp)
+{
+    struct cached *c = &d->cache[id];
+    d->reusedBytes += c->len;
+    *lenp = c->len;
+    return c->str;
+}
+
+size_t dedupBudget(struct dedup *d)
+{
+    return d->budget;
+}
+
+void dedupPrintStats(struct dedup *d, FILE *fp)
+{
+    fprintf(fp, "dedup: %llu of %llu headers were duplicates (%.1f%%), "
+	    "%.1f MB of blobs not formatted, %.1f MB of output reused, "
+	    "%.1f MB cached\n",
+	    (unsigned long long) d->ndup, (unsigned long long) d->nblobs,
+	    d->nblobs ? 100.0 * d->ndup / d->nblobs : 0.0,
+	    d->dupBytes / 1e6, d->reusedBytes / 1e6, d->cachedBytes / 1e6);
+}
+
+// ex:set ts=8 sts=4 sw=4 noet:
@@ -0,0 +1,59 @@
+// Copyright (c) 2017 Alexey Tourbin
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Identical headers, as found across the pkglists for different arches and
+// branches, are only formatted once.  The feeder hashes each blob and gives
+// it an id, the first blob with the id gets formatted, and the sink keeps
+// its output, to be reused for the duplicates.  The sink gets the results
+// in the original order, so the output is always there by the time it is
+// needed.  Internal to the library.
+
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// The blobs which are not to be cached get this id.
+#define DEDUP_NOID (UINT64_MAX >> 1)
+
+struct dedup;
+
+// The cache is limited to about budget bytes of output, after which
+// no new blobs are taken in, but the cached output is still reused.
+struct dedup *dedupNew(size_t budget);
+void dedupFree(struct dedup *d);
+
+// The 128-bit hash by which the blobs are told apart.
+void dedupHash(const void *blob, size_t size, uint64_t h[2]);
+
+// The feeder side: look up the blob, adding it if it is new.  Returns
+// the id, or DEDUP_NOID, and tells whether the blob is a duplicate.
+uint64_t dedupLookup(struct dedup *d, const void *blob, size_t size, bool *dup);
+
+// The sink side: store the output of the first blob with the id, the ids
+// come in increasing order.  Returns false on malloc failure.
+bool dedupStore(struct dedup *d, uint64_t id, const char *str, size_t len);
+
+// The sink side: the output for a duplicate.
+const char *dedupFetch(struct dedup *d, uint64_t id, size_t *lenp);
+
+size_t dedupBudget(struct dedup *d);
+void dedupPrintStats(struct dedup *d, FILE *fp);
@@ -0,0 +1,978 @@
+// Copyright (c) 2017 Alexey Tourbin
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+// The build dependency graph.  The strings only live in the decoding
+// stage: the requirements are interned as the sources come in, and once
+// the binaries come, the workers look up their names, provides, and files
+// in the table, which no longer changes, and pass back the ids.  The rest
+// is done on the ids: the graph is laid out in the CSR form, and the
+// components are found with Tarjan's algorithm.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <rpm/rpmlib.h>
+#include "pkglistquery.h"
+#include "hdrblob.h"
+#include "xstrerror.h"
+
+// An interning table, the ids being assigned in order.
+struct slot {
+    uint64_t hash;
+    uint32_t id; // 0 if the slot is empty, the id + 1 otherwise
+};
+
+struct strtab {
+    // Open addressing, at most half full.
+    size_t nslots;
+    struct slot *slots;
+    // The strings, by the id.
+    uint32_t n, alloc;
+    size_t *off;
+    char *arena;
+    size_t arenaSize, arenaAlloc;
+};
+
+// FNV-1a, good enough with the table at most half full.  The hash can
+// go on from that of a prefix, which is how the file names are hashed.
+static uint64_t hashMore(uint64_t h, const char *s, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+	h = (h ^ (unsigned char) s[i]) * 0x100000001b3ULL;
+    return h;
+}
+
+static inline uint64_t hashStr(const char *s, size_t len)
+{
+    return hashMore(0xcbf29ce484222325ULL, s, len);
+}
+
+static bool growSlots(struct slot **slotsp, size_t *nslotsp)
+{
+    size_t nslots = *nslotsp ? 2 * *nslotsp : 1 << 12;
+    struct slot *slots = calloc(nslots, sizeof *slots);
+    if (!slots)
+	return false;
+    for (size_t i = 0; i < *nslotsp; i++) {
+	struct slot *s = &(*slotsp)[i];
+	if (!s->id)
+	    continue;
+	size_t j = s->hash & (nslots - 1);
+	while (slots[j].id)
+	    j = (j + 1) & (nslots - 1);
+	slots[j] = *s;
+    }
+    free(*slotsp);
+    *slotsp = slots, *nslotsp = nslots;
+    return true;
+}
+
+static inline const char *strtabGet(const struct strtab *t, uint32_t id)
+{
+    return t->arena + t->off[id];
+}
+
+// Returns the id, or -1 if the string is not in the table.  Does not
+// change the table, and can be called from a few threads at once.
+static int64_t strtabLookup(const struct strtab *t, const char *s, size_t len)
+{
+    if (t->nslots == 0)
+	return -1;
+    uint64_t h = hashStr(s, len);
+    for (size_t j = h & (t->nslots - 1); t->slots[j].id; j = (j + 1) & (t->nslots - 1)) {
+	const struct slot *sl = &t->slots[j];
+	const char *str = strtabGet(t, sl->id - 1);
+	if (sl->hash == h && memcmp(str, s, len) == 0 && str[len] == '\0')
+	    return sl->id - 1;
+    }
+    return -1;
+}
+
+// Returns the id, adding the string if it is new, or -1 on malloc failure.
+static int64_t strtabIntern(struct strtab *t, const char *s, size_t len)
+{
+    int64_t id = strtabLookup(t, s, len);
+    if (id >= 0)
+	return id;
+    if (2 * ((size_t) t->n + 1) > t->nslots && !growSlots(&t->slots, &t->nslots))
+	return -1;
+    if (t->n == t->alloc) {
+	uint32_t alloc = t->alloc ? 2 * t->alloc : 1024;
+	size_t *off = realloc(t->off, alloc * sizeof *off);
+	if (!off)
+	    return -1;
+	t->off = off, t->alloc = alloc;
+    }
+    if (t->arenaSize + len + 1 > t->arenaAlloc) {
+	size_t alloc = t->arenaAlloc ? 2 * t->arenaAlloc : 1 << 16;
+	while (alloc < t->arenaSize + len + 1)
+	    alloc *= 2;
+	char *arena = realloc(t->arena, alloc);
+	if (!arena)
+	    return -1;
+	t->arena = arena, t->arenaAlloc = alloc;
+    }
+    memcpy(t->arena + t->arenaSize, s, len);
+    t->arena[t->arenaSize + len] = '\0';
+    t->off[t->n] = t->arenaSize;
+    t->arenaSize += len + 1;
+    uint64_t h = hashStr(s, len);
+    size_t j = h & (t->nslots - 1);
+    while (t->slots[j].id)
+	j = (j + 1) & (t->nslots - 1);
+    t->slots[j] = (struct slot) { h, t->n + 1 };
+    return t->n++;
+}
+
+static void strtabFree(struct strtab *t)
+{
+    free(t->slots);
+    free(t->off);
+    free(t->arena);
+}
+
+// A table of the hashes alone, when the strings are not kept.  With 64-bit
+// hashes, a false match is not a concern at the scale of a repository.
+struct hashtab {
+    size_t nslots;
+    struct slot *slots;
+    uint32_t n;
+};
+
+static int64_t hashtabLookup(const struct hashtab *t, uint64_t h)
+{
+    if (t->nslots == 0)
+	return -1;
+    for (size_t j = h & (t->nslots - 1); t->slots[j].id; j = (j + 1) & (t->nslots - 1))
+	if (t->slots[j].hash == h)
+	    return t->slots[j].id - 1;
+    return -1;
+}
+
+static int64_t hashtabIntern(struct hashtab *t, uint64_t h)
+{
+    int64_t id = hashtabLookup(t, h);
+    if (id >= 0)
+	return id;
+    if (2 * ((size_t) t->n + 1) > t->nslots && !growSlots(&t->slots, &t->nslots))
+	return -1;
+    size_t j = h & (t->nslots - 1);
+    while (t->slots[j].id)
+	j = (j + 1) & (t->nslots - 1);
+    t->slots[j] = (struct slot) { h, t->n + 1 };
+    return t->n++;
+}
+
+// The source of a binary which is not in the srclist.
+#define NOSRC UINT32_MAX
+
+// A requirement provided by a binary, which comes from the source.
+struct prov {
+    uint32_t req, src;
+};
+
+struct pkglistDeps {
+    int nthreads;
+    // Once the binaries are being added, the tables are frozen.
+    bool binaries;
+    bool nomem;
+    // The sources, numbered in the srclist order; the id of "N-V-R.src.rpm"
+    // is the source number.
+    struct strtab srpms;
+    struct strtab names;
+    uint32_t nsrc, srcAlloc;
+    uint32_t *nameId;
+    // The requirements of the sources, from reqStart[i] to reqStart[i+1].
+    struct strtab reqs;
+    size_t *reqStart;
+    uint32_t *req;
+    size_t nreq, reqAlloc;
+    // What the binaries provide.
+    struct prov *prov;
+    size_t nprov, provAlloc;
+};
+
+struct pkglistDeps *pkglistDepsNew(int nthreads, const char *err[2])
+{
+    struct pkglistDeps *d = calloc(1, sizeof *d);
+    if (!d) {
+	err[0] = "calloc", err[1] = xstrerror(ENOMEM);
+	return NULL;
+    }
+    d->nthreads = nthreads;
+    return d;
+}
+
+void pkglistDepsFree(struct pkglistDeps *d)
+{
+    if (!d)
+	return;
+    strtabFree(&d->srpms);
+    strtabFree(&d->names);
+    strtabFree(&d->reqs);
+    free(d->nameId);
+    free(d->reqStart);
+    free(d->req);
+    free(d->prov);
+    free(d);
+}
+
+// The job for the sources: the name, the srpm file name, and the build
+// requirements, as a run of NUL-terminated strings.
+static char *sourceJob(void *blob, unsigned blobSize, void *arg,
+		       size_t *lenp, const char *err[2])
+{
+    (void) arg;
+    const char *name = NULL, *v = NULL, *r = NULL;
+    if (hdrblobCheck(blob, blobSize)) {
+	name = hdrblobString(blob, RPMTAG_NAME);
+	v = hdrblobString(blob, RPMTAG_VERSION);
+	r = hdrblobString(blob, RPMTAG_RELEASE);
+    }
+    if (!name || !v || !r) {
+	free(blob);
+	err[0] = "sourceJob", err[1] = "malformed header";
+	return NULL;
+    }
+    unsigned nreq = 0;
+    const char *reqs = hdrblobStrings(blob, RPMTAG_REQUIRENAME, &nreq);
+    size_t reqSize = 0;
+    for (unsigned i = 0; i < nreq; i++)
+	reqSize += strlen(reqs + reqSize) + 1;
+    size_t nameSize = strlen(name) + 1;
+    int srpmLen = snprintf(NULL, 0, "%s-%s-%s.src.rpm", name, v, r);
+    char *str = malloc(nameSize + srpmLen + 1 + reqSize);
+    if (!str) {
+	free(blob);
+	err[0] = "malloc", err[1] = xstrerror(ENOMEM);
+	return NULL;
+    }
+    memcpy(str, name, nameSize);
+    sprintf(str + nameSize, "%s-%s-%s.src.rpm", name, v, r);
+    memcpy(str + nameSize + srpmLen + 1, reqs, reqSize);
+    free(blob);
+    *lenp = nameSize + srpmLen + 1 + reqSize;
+    return str;
+}
+
+static int sourceSink(void *arg, const char *str, size_t len)
+{
+    struct pkglistDeps *d = arg;
+    const char *end = str + len;
+    const char *name = str;
+    size_t nameLen = strlen(name);
+    const char *srpm = name + nameLen + 1;
+    size_t srpmLen = strlen(srpm);
+    str = srpm + srpmLen + 1;
+    int64_t id = strtabIntern(&d->srpms, srpm, srpmLen);
+    if (id < 0)
+	goto nomem;
+    // The same source again.
+    if (id < d->nsrc)
+	return 0;
+    if (d->nsrc == d->srcAlloc) {
+	uint32_t alloc = d->srcAlloc ? 2 * d->srcAlloc : 1024;
+	uint32_t *nameId = realloc(d->nameId, alloc * sizeof *nameId);
+	if (nameId)
+	    d->nameId = nameId;
+	size_t *reqStart = realloc(d->reqStart, (alloc + 1) * sizeof *reqStart);
+	if (reqStart)
+	    d->reqStart = reqStart;
+	if (!nameId || !reqStart)
+	    goto nomem;
+	d->srcAlloc = alloc;
+    }
+    int64_t nameId = strtabIntern(&d->names, name, nameLen);
+    if (nameId < 0)
+	goto nomem;
+    d->nameId[d->nsrc] = nameId;
+    d->reqStart[d->nsrc] = d->nreq;
+    for (size_t reqLen; str < end; str += reqLen + 1) {
+	reqLen = strlen(str);
+	int64_t req = strtabIntern(&d->reqs, str, reqLen);
+	if (req < 0)
+	    goto nomem;
+	if (d->nreq == d->reqAlloc) {
+	    size_t alloc = d->reqAlloc ? 2 * d->reqAlloc : 4096;
+	    uint32_t *r = realloc(d->req, alloc * sizeof *r);
+	    if (!r)
+		goto nomem;
+	    d->req = r, d->reqAlloc = alloc;
+	}
+	d->req[d->nreq++] = req;
+    }
+    d->reqStart[++d->nsrc] = d->nreq;
+    return 0;
+nomem:
+    d->nomem = true;
+    return -1;
+}
+
+// The job for the binaries: the source, or NOSRC, followed by the ids of
+// the requirements which the binary provides, by its name, provides, or
+// files; the others are of no interest.
+static char *binaryJob(void *blob, unsigned blobSize, void *arg,
+		       size_t *lenp, const char *err[2])
+{
+    struct pkglistDeps *d = arg;
+    if (!hdrblobCheck(blob, blobSize)) {
+	free(blob);
+	err[0] = "binaryJob", err[1] = "malformed header";
+	return NULL;
+    }
+    const char *name = hdrblobString(blob, RPMTAG_NAME);
+    const char *srpm = hdrblobString(blob, RPMTAG_SOURCERPM);
+    unsigned nprov = 0, nbase = 0, ndir = 0, nindex = 0;
+    const char *prov = hdrblobStrings(blob, RPMTAG_PROVIDENAME, &nprov);
+    const char *base = hdrblobStrings(blob, RPMTAG_BASENAMES, &nbase);
+    const char *dirs = hdrblobStrings(blob, RPMTAG_DIRNAMES, &ndir);
+    const uint32_t *index = hdrblobInt32s(blob, RPMTAG_DIRINDEXES, &nindex);
+    if (!dirs || !index || nindex != nbase)
+	nbase = 0;
+    uint32_t *out = malloc((2 + nprov + nbase) * sizeof *out);
+    if (!out) {
+	free(blob);
+	err[0] = "malloc", err[1] = xstrerror(ENOMEM);
+	return NULL;
+    }
+    int64_t src = srpm ? strtabLookup(&d->srpms, srpm, strlen(srpm)) : -1;
+    size_t n = 0;
+    out[n++] = src < 0 ? NOSRC : src;
+    int64_t req;
+    if (name && (req = strtabLookup(&d->reqs, name, strlen(name))) >= 0)
+	out[n++] = req;
+    for (unsigned i = 0; i < nprov; i++) {
+	size_t len = strlen(prov);
+	if ((req = strtabLookup(&d->reqs, prov, len)) >= 0)
+	    out[n++] = req;
+	prov += len + 1;
+    }
+    if (nbase) {
+	// The dirnames, to be picked by the index; the count comes from
+	// the blob, and so the array is not on the stack.
+	const char **dir = malloc(ndir * sizeof *dir + 1);
+	if (!dir) {
+	    free(out);
+	    free(blob);
+	    err[0] = "malloc", err[1] = xstrerror(ENOMEM);
+	    return NULL;
+	}
+	for (unsigned i = 0; i < ndir; i++, dirs += strlen(dirs) + 1)
+	    dir[i] = dirs;
+	char path[4096];
+	for (unsigned i = 0; i < nbase; i++, base += strlen(base) + 1) {
+	    uint32_t j = ntohl(index[i]);
+	    if (j >= ndir)
+		continue;
+	    int len = snprintf(path, sizeof path, "%s%s", dir[j], base);
+	    if (len < (int) sizeof path && (req = strtabLookup(&d->reqs, path, len)) >= 0)
+		out[n++] = req;
+	}
+	free(dir);
+    }
+    free(blob);
+    *lenp = n * sizeof *out;
+    return (char *) out;
+}
+
+static int binarySink(void *arg, const char *str, size_t len)
+{
+    struct pkglistDeps *d = arg;
+    uint32_t src, req;
+    memcpy(&src, str, sizeof src);
+    size_t n = len / sizeof req - 1;
+    if (d->nprov + n > d->provAlloc) {
+	size_t alloc = d->provAlloc ? 2 * d->provAlloc : 4096;
+	while (alloc < d->nprov + n)
+	    alloc *= 2;
+	struct prov *prov = realloc(d->prov, alloc * sizeof *prov);
+	if (!prov) {
+	    d->nomem = true;
+	    return -1;
+	}
+	d->prov = prov, d->provAlloc = alloc;
+    }
+    for (size_t i = 1; i <= n; i++) {
+	memcpy(&req, str + i * sizeof req, sizeof req);
+	d->prov[d->nprov++] = (struct prov) { req, src };
+    }
+    return 0;
+}
+
+static ssize_t addFd(struct pkglistDeps *d, int fd,
+	pkglistQueryJob job, pkglistQueryCallback cb, const char *err[2])
+{
+    struct pkglistQuery *q = pkglistQueryNewJob(job, d, d->nthreads, cb, d, err);
+    if (!q) {
+	close(fd);
+	return -1;
+    }
+    ssize_t n = pkglistQueryFd(q, fd, err);
+    // After a failure, the query is still finished, keeping the first error.
+    const char *ferr[2];
+    if (pkglistQueryFinish(q, n < 0 ? ferr : err) < 0)
+	n = -1;
+    pkglistQueryFree(q);
+    if (n < 0 && d->nomem)
+	err[0] = "malloc", err[1] = xstrerror(ENOMEM);
+    return n;
+}
+
+ssize_t pkglistDepsAddSources(struct pkglistDeps *d, int fd, const char *err[2])
+{
+    if (d->binaries) {
+	close(fd);
+	err[0] = "pkglistDepsAddSources", err[1] = "the binaries are already in";
+	return -1;
+    }
+    return addFd(d, fd, sourceJob, sourceSink, err);
+}
+
+ssize_t pkglistDepsAddBinaries(struct pkglistDeps *d, int fd, const char *err[2])
+{
+    d->binaries = true;
+    return addFd(d, fd, binaryJob, binarySink, err);
+}
+
+static int cmpId(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+    return (x > y) - (x < y);
+}
+
+// Tarjan's algorithm, without the recursion: a component is complete
+// once all the components reachable from it are complete, which makes
+// the build order.
+static int walk(struct pkglistDeps *d, const size_t *estart, const uint32_t *edge,
+	pkglistDepsCallback cb, void *arg, const char *err[2])
+{
+    uint32_t nsrc = d->nsrc;
+    struct frame {
+	uint32_t v;
+	size_t e;
+    } *call = malloc(nsrc * sizeof *call + 1);
+    uint32_t *index = malloc(nsrc * sizeof *index + 1);
+    uint32_t *low = malloc(nsrc * sizeof *low + 1);
+    uint32_t *stack = malloc(nsrc * sizeof *stack + 1);
+    unsigned char *onstack = calloc(nsrc + 1, 1);
+    const char **names = malloc(nsrc * sizeof *names + 1);
+    int rc = -1;
+    if (!call || !index || !low || !stack || !onstack || !names) {
+	err[0] = "malloc", err[1] = xstrerror(ENOMEM);
+	goto out;
+    }
+    for (uint32_t v = 0; v < nsrc; v++)
+	index[v] = NOSRC;
+    uint32_t counter = 0, nstack = 0, step = 0;
+    for (uint32_t root = 0; root < nsrc; root++) {
+	if (index[root] != NOSRC)
+	    continue;
+	size_t ncall = 0;
+	index[root] = low[root] = counter++;
+	stack[nstack++] = root, onstack[root] = 1;
+	call[ncall++] = (struct frame) { root, estart[root] };
+	while (ncall) {
+	    struct frame *f = &call[ncall - 1];
+	    uint32_t v = f->v;
+	    if (f->e < estart[v + 1]) {
+		uint32_t w = edge[f->e++];
+		if (index[w] == NOSRC) {
+		    index[w] = low[w] = counter++;
+		    stack[nstack++] = w, onstack[w] = 1;
+		    call[ncall++] = (struct frame) { w, estart[w] };
+		}
+		else if (onstack[w] && index[w] < low[v])
+		    low[v] = index[w];
+		continue;
+	    }
+	    if (low[v] == index[v]) {
+		uint32_t top = nstack;
+		do
+		    onstack[stack[--nstack]] = 0;
+		while (stack[nstack] != v);
+		uint32_t n = top - nstack;
+		qsort(stack + nstack, n, sizeof *stack, cmpId);
+		for (uint32_t i = 0; i < n; i++)
+		    names[i] = strtabGet(&d->names, d->nameId[stack[nstack + i]]);
+		if (cb(arg, ++step, names, n)) {
+		    err[0] = "pkglistDepsOrder", err[1] = "stopped";
+		    goto out;
+		}
+	    }
+	    if (--ncall) {
+		uint32_t u = call[ncall - 1].v;
+		if (low[v] < low[u])
+		    low[u] = low[v];
+	    }
+	}
+    }
+    rc = 0;
+out:
+    free(call), free(index), free(low), free(stack), free(onstack), free(names);
+    return rc;
+}
+
+int pkglistDepsOrder(struct pkglistDeps *d, pkglistDepsCallback cb, void *arg,
+	size_t *unresolved, const char *err[2])
+{
+    uint32_t nreq = d->reqs.n, nsrc = d->nsrc;
+    // The providers of each requirement, in the CSR form.
+    size_t *pstart = calloc(nreq + 1, sizeof *pstart);
+    uint32_t *psrc = malloc(d->nprov * sizeof *psrc + 1);
+    // The edges, from each source to those which are to be built first.
+    size_t *estart = malloc((nsrc + 1) * sizeof *estart);
+    uint32_t *edge = NULL;
+    size_t nedge = 0, edgeAlloc = 0;
+    // The last source to have an edge to the source, plus one.
+    uint32_t *mark = calloc(nsrc + 1, sizeof *mark);
+    unsigned char *seen = calloc(nreq + 1, 1);
+    int rc = -1;
+    if (!pstart || !psrc || !estart || !mark || !seen)
+	goto nomem;
+    for (size_t i = 0; i < d->nprov; i++)
+	pstart[d->prov[i].req + 1]++;
+    for (uint32_t r = 0; r < nreq; r++)
+	pstart[r + 1] += pstart[r];
+    // Each start is advanced to the next one, then shifted back.
+    for (size_t i = 0; i < d->nprov; i++)
+	psrc[pstart[d->prov[i].req]++] = d->prov[i].src;
+    memmove(pstart + 1, pstart, nreq * sizeof *pstart);
+    pstart[0] = 0;
+    size_t nunres = 0;
+    for (uint32_t u = 0; u < nsrc; u++) {
+	estart[u] = nedge;
+	for (size_t k = d->reqStart[u]; k < d->reqStart[u + 1]; k++) {
+	    uint32_t r = d->req[k];
+	    if (pstart[r] == pstart[r + 1]) {
+		if (!seen[r] && strncmp(strtabGet(&d->reqs, r), "rpmlib(", 7))
+		    nunres++;
+		seen[r] = 1;
+		continue;
+	    }
+	    for (size_t p = pstart[r]; p < pstart[r + 1]; p++) {
+		uint32_t v = psrc[p];
+		// A source which builds with its own binaries
+		// can only be bootstrapped, which is not a concern here.
+		if (v == NOSRC || v == u || mark[v] == u + 1)
+		    continue;
+		mark[v] = u + 1;
+		if (nedge == edgeAlloc) {
+		    size_t alloc = edgeAlloc ? 2 * edgeAlloc : 4096;
+		    uint32_t *e = realloc(edge, alloc * sizeof *e);
+		    if (!e)
+			goto nomem;
+		    edge = e, edgeAlloc = alloc;
+		}
+		edge[nedge++] = v;
+	    }
+	}
+    }
+    estart[nsrc] = nedge;
+    if (unresolved)
+	*unresolved = nunres;
+    rc = walk(d, estart, edge, cb, arg, err);
+    goto out;
+nomem:
+    err[0] = "malloc", err[1] = xstrerror(ENOMEM);
+out:
+    free(pstart), free(psrc), free(estart), free(edge), free(mark), free(seen);
+    return rc;
+}
+
+// The reverse dependencies of the binaries.  Here the capabilities come
+// all in one pass, so that it is not known which provides and files will
+// be needed: the workers only hash them, and the sink keeps the hashes.
+// The graph is built on the first walk: the required hashes get the ids,
+// the provides which are not required are dropped, and the requirers of
+// each package are laid out in the CSR form.
+struct hashPkg {
+    uint64_t hash; // or the id, once the hashes are looked up
+    uint32_t pkg;
+};
+
+// The walk's marks, in place of the parent.
+#define NOPARENT UINT32_MAX
+#define UNSEEN (UINT32_MAX - 1)
+
+struct pkglistRdeps {
+    int nthreads;
+    bool nomem;
+    // The packages, in the order read, by the name.
+    uint32_t npkg, pkgAlloc;
+    size_t *nameOff;
+    char *names;
+    size_t namesSize, namesAlloc;
+    // The hashes, before the graph is built.
+    struct hashPkg *prov, *req;
+    size_t nprov, provAlloc, nreq, reqAlloc;
+    // The graph: the requirers by the requirement, and by the package.
+    bool built;
+    struct hashtab reqs;
+    size_t *rqStart;
+    uint32_t *rq;
+    size_t *revStart;
+    uint32_t *rev;
+};
+
+struct pkglistRdeps *pkglistRdepsNew(int nthreads, const char *err[2])
+{
+    struct pkglistRdeps *r = calloc(1, sizeof *r);
+    if (!r) {
+	err[0] = "calloc", err[1] = xstrerror(ENOMEM);
+	return NULL;
+    }
+    r->nthreads = nthreads;
+    return r;
+}
+
+void pkglistRdepsFree(struct pkglistRdeps *r)
+{
+    if (!r)
+	return;
+    free(r->nameOff);
+    free(r->names);
+    free(r->prov);
+    free(r->req);
+    free(r->reqs.slots);
+    free(r->rqStart);
+    free(r->rq);
+    free(r->revStart);
+    free(r->rev);
+    free(r);
+}
+
+// The job for the binaries: the number of the provides (the name
+// included) and of the requirements, their hashes, and the name.
+static char *rdepsJob(void *blob, unsigned blobSize, void *arg,
+		      size_t *lenp, const char *err[2])
+{
+    (void) arg;
+    const char *name = NULL;
+    if (hdrblobCheck(blob, blobSize))
+	name = hdrblobString(blob, RPMTAG_NAME);
+    if (!name) {
+	free(blob);
+	err[0] = "rdepsJob", err[1] = "malformed header";
+	return NULL;
+    }
+    unsigned nprov = 0, nreq = 0, nbase = 0, ndir = 0, nindex = 0;
+    const char *prov = hdrblobStrings(blob, RPMTAG_PROVIDENAME, &nprov);
+    const char *req = hdrblobStrings(blob, RPMTAG_REQUIRENAME, &nreq);
+    const char *base = hdrblobStrings(blob, RPMTAG_BASENAMES, &nbase);
+    const char *dirs = hdrblobStrings(blob, RPMTAG_DIRNAMES, &ndir);
+    const uint32_t *index = hdrblobInt32s(blob, RPMTAG_DIRINDEXES, &nindex);
+    if (!dirs || !index || nindex != nbase)
+	nbase = 0;
+    size_t nameSize = strlen(name) + 1;
+    uint32_t nn[2] = { 0, 0 };
+    size_t size = sizeof nn + (1 + nprov + nbase + nreq) * sizeof(uint64_t) + nameSize;
+    char *str = malloc(size);
+    if (!str) {
+	free(blob);
+	err[0] = "malloc", err[1] = xstrerror(ENOMEM);
+	return NULL;
+    }
+    uint64_t h, *hp = (uint64_t *) (str + sizeof nn);
+    h = hashStr(name, nameSize - 1), memcpy(hp + nn[0]++, &h, sizeof h);
+    for (unsigned i = 0; i < nprov; i++) {
+	size_t len = strlen(prov);
+	h = hashStr(prov, len), memcpy(hp + nn[0]++, &h, sizeof h);
+	prov += len + 1;
+    }
+    if (nbase) {
+	// Not on the stack, the count comes from the blob.
+	uint64_t *dh = malloc(ndir * sizeof *dh + 1);
+	if (!dh) {
+	    free(str);
+	    free(blob);
+	    err[0] = "malloc", err[1] = xstrerror(ENOMEM);
+	    return NULL;
+	}
+	for (unsigned i = 0; i < ndir; i++) {
+	    size_t len = strlen(dirs);
+	    dh[i] = hashStr(dirs, len);
+	    dirs += len + 1;
+	}
+	for (unsigned i = 0; i < nbase; i++) {
+	    size_t len = strlen(base);
+	    uint32_t j = ntohl(index[i]);
+	    if (j < ndir)
+		h = hashMore(dh[j], base, len), memcpy(hp + nn[0]++, &h, sizeof h);
+	    base += len + 1;
+	}
+	free(dh);
+    }
+    for (unsigned i = 0; i < nreq; i++) {
+	size_t len = strlen(req);
+	if (strncmp(req, "rpmlib(", 7))
+	    h = hashStr(req, len), memcpy(hp + nn[0] + nn[1]++, &h, sizeof h);
+	req += len + 1;
+    }
+    memcpy(str, nn, sizeof nn);
+    char *namep = (char *) (hp + nn[0] + nn[1]);
+    memcpy(namep, name, nameSize);
+    free(blob);
+    *lenp = namep + nameSize - str;
+    return str;
+}
+
+static bool addHashes(struct hashPkg **ap, size_t *np, size_t *allocp,
+	const char *hp, uint32_t n, uint32_t pkg)
+{
+    if (*np + n > *allocp) {
+	size_t alloc = *allocp ? 2 * *allocp : 1 << 16;
+	while (alloc < *np + n)
+	    alloc *= 2;
+	struct hashPkg *a = realloc(*ap, alloc * sizeof *a);
+	if (!a)
+	    return false;
+	*ap = a, *allocp = alloc;
+    }
+    for (uint32_t i = 0; i < n; i++) {
+	struct hashPkg *e = &(*ap)[(*np)++];
+	memcpy(&e->hash, hp + i * sizeof e->hash, sizeof e->hash);
+	e->pkg = pkg;
+    }
+    return true;
+}
+
+static int rdepsSink(void *arg, const char *str, size_t len)
+{
+    struct pkglistRdeps *r = arg;
+    (void) len;
+    uint32_t nn[2];
+    memcpy(nn, str, sizeof nn);
+    const char *hp = str + sizeof nn;
+    const char *name = hp + (nn[0] + nn[1]) * sizeof(uint64_t);
+    size_t nameSize = strlen(name) + 1;
+    if (r->npkg == r->pkgAlloc) {
+	uint32_t alloc = r->pkgAlloc ? 2 * r->pkgAlloc : 4096;
+	size_t *nameOff = realloc(r->nameOff, alloc * sizeof *nameOff);
+	if (!nameOff)
+	    goto nomem;
+	r->nameOff = nameOff, r->pkgAlloc = alloc;
+    }
+    if (r->namesSize + nameSize > r->namesAlloc) {
+	size_t alloc = r->namesAlloc ? 2 * r->namesAlloc : 1 << 16;
+	while (alloc < r->namesSize + nameSize)
+	    alloc *= 2;
+	char *names = realloc(r->names, alloc);
+	if (!names)
+	    goto nomem;
+	r->names = names, r->namesAlloc = alloc;
+    }
+    if (!addHashes(&r->prov, &r->nprov, &r->provAlloc, hp, nn[0], r->npkg) ||
+	!addHashes(&r->req, &r->nreq, &r->reqAlloc, hp + nn[0] * sizeof(uint64_t), nn[1], r->npkg))
+	goto nomem;
+    memcpy(r->names + r->namesSize, name, nameSize);
+    r->nameOff[r->npkg++] = r->namesSize;
+    r->namesSize += nameSize;
+    return 0;
+nomem:
+    r->nomem = true;
+    return -1;
+}
+
+ssize_t pkglistRdepsAdd(struct pkglistRdeps *r, int fd, const char *err[2])
+{
+    if (r->built) {
+	close(fd);
+	err[0] = "pkglistRdepsAdd", err[1] = "the graph is already built";
+	return -1;
+    }
+    struct pkglistQuery *q = pkglistQueryNewJob(rdepsJob, r, r->nthreads, rdepsSink, r, err);
+    if (!q) {
+	close(fd);
+	return -1;
+    }
+    ssize_t n = pkglistQueryFd(q, fd, err);
+    const char *ferr[2];
+    if (pkglistQueryFinish(q, n < 0 ? ferr : err) < 0)
+	n = -1;
+    pkglistQueryFree(q);
+    if (n < 0 && r->nomem)
+	err[0] = "malloc", err[1] = xstrerror(ENOMEM);
+    return n;
+}
+
+static bool buildRdeps(struct pkglistRdeps *r)
+{
+    uint32_t npkg = r->npkg;
+    // The requirements get the ids, and the pairs are turned
+    // into the requirers by the id.
+    uint32_t *reqId = malloc(r->nreq * sizeof *reqId + 1);
+    if (!reqId)
+	return false;
+    for (size_t k = 0; k < r->nreq; k++) {
+	int64_t id = hashtabIntern(&r->reqs, r->req[k].hash);
+	if (id < 0) {
+	    free(reqId);
+	    return false;
+	}
+	reqId[k] = id;
+    }
+    uint32_t nid = r->reqs.n;
+    size_t *pstart = calloc(nid + 1, sizeof *pstart);
+    uint32_t *psrc = malloc(r->nprov * sizeof *psrc + 1);
+    uint32_t *last = calloc(npkg + 1, sizeof *last);
+    r->rqStart = calloc(nid + 1, sizeof *r->rqStart);
+    r->rq = malloc(r->nreq * sizeof *r->rq + 1);
+    r->revStart = calloc(npkg + 1, sizeof *r->revStart);
+    bool ok = false;
+    if (!pstart || !psrc || !last || !r->rqStart || !r->rq || !r->revStart)
+	goto out;
+    // The requirers of each requirement, then the providers; the starts
+    // are advanced to the next ones while filling, then shifted back.
+    for (size_t k = 0; k < r->nreq; k++)
+	r->rqStart[reqId[k] + 1]++;
+    for (uint32_t i = 0; i < nid; i++)
+	r->rqStart[i + 1] += r->rqStart[i];
+    for (size_t k = 0; k < r->nreq; k++)
+	r->rq[r->rqStart[reqId[k]]++] = r->req[k].pkg;
+    memmove(r->rqStart + 1, r->rqStart, nid * sizeof *r->rqStart);
+    r->rqStart[0] = 0;
+    size_t nprov = 0;
+    for (size_t k = 0; k < r->nprov; k++) {
+	int64_t id = hashtabLookup(&r->reqs, r->prov[k].hash);
+	if (id >= 0)
+	    pstart[id + 1]++, r->prov[nprov++] = (struct hashPkg) { id, r->prov[k].pkg };
+    }
+    for (uint32_t i = 0; i < nid; i++)
+	pstart[i + 1] += pstart[i];
+    for (size_t k = 0; k < nprov; k++)
+	psrc[pstart[r->prov[k].hash]++] = r->prov[k].pkg;
+    memmove(pstart + 1, pstart, nid * sizeof *pstart);
+    pstart[0] = 0;
+    // The requirers of each package, once each: the requirements come
+    // in the order of the requirers, so the duplicates are adjacent.
+    for (int pass = 0; pass < 2; pass++) {
+	memset(last, 0, npkg * sizeof *last);
+	for (size_t k = 0; k < r->nreq; k++) {
+	    uint32_t q = r->req[k].pkg, id = reqId[k];
+	    for (size_t j = pstart[id]; j < pstart[id + 1]; j++) {
+		uint32_t p = psrc[j];
+		if (last[p] == q + 1)
+		    continue;
+		last[p] = q + 1;
+		if (pass == 0)
+		    r->revStart[p + 1]++;
+		else
+		    r->rev[r->revStart[p]++] = q;
+	    }
+	}
+	if (pass == 0) {
+	    for (uint32_t p = 0; p < npkg; p++)
+		r->revStart[p + 1] += r->revStart[p];
+	    r->rev = malloc(r->revStart[npkg] * sizeof *r->rev + 1);
+	    if (!r->rev)
+		goto out;
+	}
+    }
+    memmove(r->revStart + 1, r->revStart, npkg * sizeof *r->revStart);
+    r->revStart[0] = 0;
+    free(r->prov), r->prov = NULL, r->nprov = 0;
+    free(r->req), r->req = NULL, r->nreq = 0;
+    r->built = ok = true;
+out:
+    free(reqId), free(pstart), free(psrc), free(last);
+    return ok;
+}
+
+int pkglistRdepsWalk(struct pkglistRdeps *r, const char *what, unsigned maxDepth,
+	pkglistRdepsCallback cb, void *arg, const char *err[2])
+{
+    if (!r->built && !buildRdeps(r)) {
+	err[0] = "malloc", err[1] = xstrerror(ENOMEM);
+	return -1;
+    }
+    uint32_t npkg = r->npkg;
+    uint32_t *queue = malloc(npkg * sizeof *queue + 1);
+    uint32_t *parent = malloc(npkg * sizeof *parent + 1);
+    unsigned *depth = malloc(npkg * sizeof *depth + 1);
+    const char **path = malloc((npkg + 2) * sizeof *path);
+    int n = -1;
+    if (!queue || !parent || !depth || !path) {
+	err[0] = "malloc", err[1] = xstrerror(ENOMEM);
+	goto out;
+    }
+    for (uint32_t p = 0; p < npkg; p++)
+	parent[p] = UNSEEN;
+    // With a package name, its packages are the roots, at depth 0;
+    // otherwise, the capability is, and its requirers are at depth 1.
+    uint32_t head = 0, tail = 0;
+    for (uint32_t p = 0; p < npkg; p++)
+	if (strcmp(r->names + r->nameOff[p], what) == 0)
+	    parent[p] = NOPARENT, depth[p] = 0, queue[tail++] = p;
+    bool cap = tail == 0;
+    n = 0;
+    if (cap) {
+	int64_t id = hashtabLookup(&r->reqs, hashStr(what, strlen(what)));
+	if (id < 0)
+	    goto out;
+	for (size_t j = r->rqStart[id]; j < r->rqStart[id + 1]; j++) {
+	    uint32_t q = r->rq[j];
+	    if (parent[q] != UNSEEN)
+		continue;
+	    parent[q] = NOPARENT, depth[q] = 1, queue[tail++] = q;
+	}
+    }
+    // The packages are reported as they are queued, along with the path
+    // back to the root.
+    for (uint32_t i = 0; ; ) {
+	for (; i < tail; i++) {
+	    uint32_t q = queue[i];
+	    if (depth[q] == 0)
+		continue;
+	    unsigned len = 0;
+	    for (uint32_t p = q; p != NOPARENT; p = parent[p])
+		path[len++] = r->names + r->nameOff[p];
+	    if (cap)
+		path[len++] = what;
+	    n++;
+	    if (cb(arg, depth[q], path, len)) {
+		err[0] = "pkglistRdepsWalk", err[1] = "stopped";
+		n = -1;
+		goto out;
+	    }
+	}
+	if (head == tail)
+	    break;
+	uint32_t p = queue[head++];
+	if (maxDepth && depth[p] >= maxDepth)
+	    continue;
+	for (size_t j = r->revStart[p]; j < r->revStart[p + 1]; j++) {
+	    uint32_t q = r->rev[j];
+	    if (parent[q] != UNSEEN)
+		continue;
+	    parent[q] = p, depth[q] = depth[p] + 1, queue[tail++] = q;
+	}
+    }
+out:
+    free(queue), free(parent), free(depth), free(path);
+    return n;
+}
+
+// ex:set ts=8 sts=4 sw=4 noet:
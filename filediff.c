@@ -0,0 +1,524 @@
+// Copyright (c) 2017 Alexey Tourbin
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+// The file-list diff between two snapshots.  The old packages are read
+// first, each one turned by a worker into a record: the key, the name,
+// and the sorted file names.  Then the new packages are paired with the
+// old ones by the name, on the workers: if the keys match, the header
+// is the same, and its files are not even looked at; otherwise, the two
+// sorted lists are merged.  The moves between the packages are only
+// found at the end, when all the changes are in.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <rpm/rpmlib.h>
+#include "pkglistquery.h"
+#include "hdrblob.h"
+#include "dedup.h"
+#include "xstrerror.h"
+
+// FNV-1a, good enough with the table at most half full.
+static uint64_t hashStr(const char *s)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (; *s; s++)
+	h = (h ^ (unsigned char) *s) * 0x100000001b3ULL;
+    return h;
+}
+
+struct slot {
+    uint64_t hash;
+    uint32_t id; // 0 if the slot is empty, the id + 1 otherwise
+};
+
+// The key, which tells the same headers: the hash of SHA1HEADER, which
+// covers the files, or else of the whole blob.
+#define KEYSIZE 16
+
+// An old package's record, as made by oldJob: the key, the name,
+// and the file names, all of them NUL-terminated and sorted.
+struct oldPkg {
+    char *rec;
+    size_t size;
+    // Set by the workers, once the package is paired.
+    unsigned char seen;
+};
+
+struct pkglistDiff {
+    int nthreads;
+    // Once the new packages are being added, the old ones are frozen.
+    bool news;
+    bool nomem;
+    struct oldPkg *old;
+    uint32_t nold, oldAlloc;
+    // The old packages by the name, open addressing, at most half full.
+    size_t nslots;
+    struct slot *slots;
+    // The changes to the new packages, as made by newJob: the name,
+    // then each file name prefixed with '+' or '-'.
+    char **chg;
+    size_t *chgSize;
+    size_t nchg, chgAlloc;
+};
+
+static inline const char *oldName(const struct oldPkg *o)
+{
+    return o->rec + KEYSIZE;
+}
+
+struct pkglistDiff *pkglistDiffNew(int nthreads, const char *err[2])
+{
+    struct pkglistDiff *d = calloc(1, sizeof *d);
+    if (!d) {
+	err[0] = "calloc", err[1] = xstrerror(ENOMEM);
+	return NULL;
+    }
+    d->nthreads = nthreads;
+    return d;
+}
+
+void pkglistDiffFree(struct pkglistDiff *d)
+{
+    if (!d)
+	return;
+    for (uint32_t i = 0; i < d->nold; i++)
+	free(d->old[i].rec);
+    free(d->old);
+    free(d->slots);
+    for (size_t i = 0; i < d->nchg; i++)
+	free(d->chg[i]);
+    free(d->chg);
+    free(d->chgSize);
+    free(d);
+}
+
+// Returns the old package by the name, or NULL.  Does not change
+// the table, and can be called from a few threads at once.
+static struct oldPkg *lookup(const struct pkglistDiff *d, const char *name)
+{
+    if (d->nslots == 0)
+	return NULL;
+    uint64_t h = hashStr(name);
+    for (size_t j = h & (d->nslots - 1); d->slots[j].id; j = (j + 1) & (d->nslots - 1)) {
+	struct oldPkg *o = &d->old[d->slots[j].id - 1];
+	if (d->slots[j].hash == h && strcmp(oldName(o), name) == 0)
+	    return o;
+    }
+    return NULL;
+}
+
+static bool grow(struct pkglistDiff *d)
+{
+    size_t nslots = d->nslots ? 2 * d->nslots : 1 << 12;
+    struct slot *slots = calloc(nslots, sizeof *slots);
+    if (!slots)
+	return false;
+    for (size_t i = 0; i < d->nslots; i++) {
+	struct slot *s = &d->slots[i];
+	if (!s->id)
+	    continue;
+	size_t j = s->hash & (nslots - 1);
+	while (slots[j].id)
+	    j = (j + 1) & (nslots - 1);
+	slots[j] = *s;
+    }
+    free(d->slots);
+    d->slots = slots, d->nslots = nslots;
+    return true;
+}
+
+static void blobKey(const void *blob, size_t blobSize, char key[KEYSIZE])
+{
+    uint64_t h[2];
+    const char *sha1 = hdrblobString(blob, RPMTAG_SHA1HEADER);
+    if (sha1)
+	dedupHash(sha1, strlen(sha1), h);
+    else
+	dedupHash(blob, blobSize, h);
+    memcpy(key, h, KEYSIZE);
+}
+
+static int cmpStr(const void *a, const void *b)
+{
+    return strcmp(*(const char **) a, *(const char **) b);
+}
+
+// The file names of the header, sorted, in a malloc'd block: n pointers,
+// followed by the strings, which take *sizep bytes.  Returns NULL
+// on malloc failure.
+static const char **fileList(const void *blob, unsigned *np, size_t *sizep)
+{
+    unsigned nbase = 0, ndir = 0, nindex = 0;
+    const char *base = hdrblobStrings(blob, RPMTAG_BASENAMES, &nbase);
+    const char *dirs = hdrblobStrings(blob, RPMTAG_DIRNAMES, &ndir);
+    const uint32_t *index = hdrblobInt32s(blob, RPMTAG_DIRINDEXES, &nindex);
+    if (!base || !dirs || !index || nindex != nbase)
+	nbase = 0;
+    // The count comes from the blob, and so the arrays are not on the stack.
+    const char **dir = malloc((ndir + 1) * (sizeof *dir + sizeof(size_t)));
+    if (!dir)
+	return NULL;
+    size_t *dirLen = (size_t *) (dir + ndir + 1);
+    for (unsigned i = 0; i < ndir; i++) {
+	dir[i] = dirs, dirLen[i] = strlen(dirs);
+	dirs += dirLen[i] + 1;
+    }
+    size_t size = 0;
+    const char *b = base;
+    for (unsigned i = 0; i < nbase; i++) {
+	size_t len = strlen(b);
+	uint32_t j = ntohl(index[i]);
+	size += (j < ndir ? dirLen[j] : 0) + len + 1;
+	b += len + 1;
+    }
+    const char **files = malloc(nbase * sizeof *files + size + 1);
+    if (!files) {
+	free(dir);
+	return NULL;
+    }
+    char *p = (char *) (files + nbase);
+    bool sorted = true;
+    for (unsigned i = 0; i < nbase; i++) {
+	size_t len = strlen(base);
+	uint32_t j = ntohl(index[i]);
+	files[i] = p;
+	if (j < ndir)
+	    memcpy(p, dir[j], dirLen[j]), p += dirLen[j];
+	memcpy(p, base, len + 1), p += len + 1;
+	base += len + 1;
+	// Usually, rpm has them sorted already.
+	if (i && sorted && strcmp(files[i - 1], files[i]) > 0)
+	    sorted = false;
+    }
+    free(dir);
+    if (!sorted)
+	qsort(files, nbase, sizeof *files, cmpStr);
+    *np = nbase, *sizep = size;
+    return files;
+}
+
+// The job for the old packages, making the records.
+static char *oldJob(void *blob, unsigned blobSize, void *arg,
+		    size_t *lenp, const char *err[2])
+{
+    (void) arg;
+    const char *name = NULL;
+    if (hdrblobCheck(blob, blobSize))
+	name = hdrblobString(blob, RPMTAG_NAME);
+    if (!name) {
+	free(blob);
+	err[0] = "oldJob", err[1] = "malformed header";
+	return NULL;
+    }
+    unsigned n;
+    size_t size;
+    const char **files = fileList(blob, &n, &size);
+    size_t nameSize = strlen(name) + 1;
+    char *rec = files ? malloc(KEYSIZE + nameSize + size + 1) : NULL;
+    if (!rec) {
+	free(files);
+	free(blob);
+	err[0] = "malloc", err[1] = xstrerror(ENOMEM);
+	return NULL;
+    }
+    blobKey(blob, blobSize, rec);
+    char *p = rec + KEYSIZE;
+    memcpy(p, name, nameSize), p += nameSize;
+    for (unsigned i = 0; i < n; i++) {
+	size_t len = strlen(files[i]) + 1;
+	memcpy(p, files[i], len), p += len;
+    }
+    free(files);
+    free(blob);
+    *lenp = p - rec;
+    return rec;
+}
+
+static int oldSink(void *arg, const char *str, size_t len)
+{
+    struct pkglistDiff *d = arg;
+    // With a few packages of the name, the first one is taken.
+    if (lookup(d, str + KEYSIZE))
+	return 0;
+    if (d->nold == d->oldAlloc) {
+	uint32_t alloc = d->oldAlloc ? 2 * d->oldAlloc : 1024;
+	struct oldPkg *old = realloc(d->old, alloc * sizeof *old);
+	if (!old)
+	    goto nomem;
+	d->old = old, d->oldAlloc = alloc;
+    }
+    if (2 * ((size_t) d->nold + 1) > d->nslots && !grow(d))
+	goto nomem;
+    char *rec = malloc(len + 1);
+    if (!rec)
+	goto nomem;
+    memcpy(rec, str, len);
+    rec[len] = '\0';
+    d->old[d->nold] = (struct oldPkg) { rec, len, 0 };
+    uint64_t h = hashStr(rec + KEYSIZE);
+    size_t j = h & (d->nslots - 1);
+    while (d->slots[j].id)
+	j = (j + 1) & (d->nslots - 1);
+    d->slots[j] = (struct slot) { h, ++d->nold };
+    return 0;
+nomem:
+    d->nomem = true;
+    return -1;
+}
+
+// The job for the new packages: pair the package with the old one,
+// and merge the file lists, unless the header is the same.  The result
+// is empty if nothing has changed.
+static char *newJob(void *blob, unsigned blobSize, void *arg,
+		    size_t *lenp, const char *err[2])
+{
+    struct pkglistDiff *d = arg;
+    const char *name = NULL;
+    if (hdrblobCheck(blob, blobSize))
+	name = hdrblobString(blob, RPMTAG_NAME);
+    if (!name) {
+	free(blob);
+	err[0] = "newJob", err[1] = "malformed header";
+	return NULL;
+    }
+    struct oldPkg *o = lookup(d, name);
+    if (o) {
+	__atomic_store_n(&o->seen, 1, __ATOMIC_RELAXED);
+	char key[KEYSIZE];
+	blobKey(blob, blobSize, key);
+	if (memcmp(key, o->rec, KEYSIZE) == 0) {
+	    free(blob);
+	    char *str = malloc(1);
+	    if (!str) {
+		err[0] = "malloc", err[1] = xstrerror(ENOMEM);
+		return NULL;
+	    }
+	    *str = '\0', *lenp = 0;
+	    return str;
+	}
+    }
+    unsigned n;
+    size_t size;
+    const char **files = fileList(blob, &n, &size);
+    size_t nameSize = strlen(name) + 1;
+    // Each file name gets the sign; the old ones take at least two bytes
+    // each, with the NUL, so that their signs take no more than that.
+    size_t max = nameSize + size + n;
+    if (o)
+	max += 2 * o->size;
+    char *str = files ? malloc(max + 1) : NULL;
+    if (!str) {
+	free(files);
+	free(blob);
+	err[0] = "malloc", err[1] = xstrerror(ENOMEM);
+	return NULL;
+    }
+    char *p = str;
+    memcpy(p, name, nameSize), p += nameSize;
+    const char *ofile = NULL, *oend = NULL;
+    if (o) {
+	ofile = oldName(o) + strlen(oldName(o)) + 1;
+	oend = o->rec + o->size;
+    }
+    unsigned i = 0;
+    while (i < n || ofile < oend) {
+	int cmp = i == n ? -1 : ofile == oend ? 1 : strcmp(ofile, files[i]);
+	const char *f = cmp < 0 ? ofile : files[i];
+	size_t len = strlen(f) + 1;
+	if (cmp)
+	    *p++ = cmp < 0 ? '-' : '+', memcpy(p, f, len), p += len;
+	if (cmp <= 0)
+	    ofile += len;
+	if (cmp >= 0)
+	    i++;
+    }
+    free(files);
+    free(blob);
+    *lenp = p - str;
+    // The same files, in a different header.
+    if (p == str + nameSize)
+	*str = '\0', *lenp = 0;
+    return str;
+}
+
+static int newSink(void *arg, const char *str, size_t len)
+{
+    struct pkglistDiff *d = arg;
+    if (len == 0)
+	return 0;
+    if (d->nchg == d->chgAlloc) {
+	size_t alloc = d->chgAlloc ? 2 * d->chgAlloc : 1024;
+	char **chg = realloc(d->chg, alloc * sizeof *chg);
+	if (chg)
+	    d->chg = chg;
+	size_t *chgSize = realloc(d->chgSize, alloc * sizeof *chgSize);
+	if (chgSize)
+	    d->chgSize = chgSize;
+	if (!chg || !chgSize)
+	    goto nomem;
+	d->chgAlloc = alloc;
+    }
+    char *copy = malloc(len);
+    if (!copy)
+	goto nomem;
+    memcpy(copy, str, len);
+    d->chg[d->nchg] = copy;
+    d->chgSize[d->nchg++] = len;
+    return 0;
+nomem:
+    d->nomem = true;
+    return -1;
+}
+
+static ssize_t addFd(struct pkglistDiff *d, int fd,
+	pkglistQueryJob job, pkglistQueryCallback cb, const char *err[2])
+{
+    struct pkglistQuery *q = pkglistQueryNewJob(job, d, d->nthreads, cb, d, err);
+    if (!q) {
+	close(fd);
+	return -1;
+    }
+    ssize_t n = pkglistQueryFd(q, fd, err);
+    // After a failure, the query is still finished, keeping the first error.
+    const char *ferr[2];
+    if (pkglistQueryFinish(q, n < 0 ? ferr : err) < 0)
+	n = -1;
+    pkglistQueryFree(q);
+    if (n < 0 && d->nomem)
+	err[0] = "malloc", err[1] = xstrerror(ENOMEM);
+    return n;
+}
+
+ssize_t pkglistDiffAddOld(struct pkglistDiff *d, int fd, const char *err[2])
+{
+    if (d->news) {
+	close(fd);
+	err[0] = "pkglistDiffAddOld", err[1] = "the new packages are already in";
+	return -1;
+    }
+    return addFd(d, fd, oldJob, oldSink, err);
+}
+
+ssize_t pkglistDiffAddNew(struct pkglistDiff *d, int fd, const char *err[2])
+{
+    d->news = true;
+    return addFd(d, fd, newJob, newSink, err);
+}
+
+// A change, the file name pointing into the records.
+struct change {
+    const char *name;
+    const char *file;
+    const char *from; // the package it has moved from
+    char op;
+};
+
+int pkglistDiffFinish(struct pkglistDiff *d, pkglistDiffCallback cb, void *arg,
+	const char *err[2])
+{
+    // The changes to the new packages come in their order, then the old
+    // packages which are gone.
+    size_t n = 0, nadd = 0;
+    for (size_t i = 0; i < d->nchg; i++) {
+	const char *p = d->chg[i], *end = p + d->chgSize[i];
+	for (p += strlen(p) + 1; p < end; p += strlen(p) + 1)
+	    n++, nadd += *p == '+';
+    }
+    for (uint32_t i = 0; i < d->nold; i++) {
+	struct oldPkg *o = &d->old[i];
+	if (o->seen)
+	    continue;
+	const char *p = oldName(o), *end = o->rec + o->size;
+	for (p += strlen(p) + 1; p < end; p += strlen(p) + 1)
+	    n++;
+    }
+    struct change *chg = malloc(n * sizeof *chg + 1);
+    // The added files, by the name, to match the removed ones against.
+    size_t nslots = 1;
+    while (nslots < 2 * nadd)
+	nslots *= 2;
+    struct slot *slots = calloc(nslots, sizeof *slots);
+    if (!chg || !slots) {
+	free(chg), free(slots);
+	err[0] = "malloc", err[1] = xstrerror(ENOMEM);
+	return -1;
+    }
+    n = 0;
+    for (size_t i = 0; i < d->nchg; i++) {
+	const char *name = d->chg[i], *end = name + d->chgSize[i];
+	for (const char *p = name + strlen(name) + 1; p < end; p += strlen(p) + 1) {
+	    chg[n] = (struct change) { name, p + 1, NULL, *p };
+	    if (*p == '+') {
+		uint64_t h = hashStr(p + 1);
+		size_t j = h & (nslots - 1);
+		while (slots[j].id)
+		    j = (j + 1) & (nslots - 1);
+		slots[j] = (struct slot) { h, n + 1 };
+	    }
+	    n++;
+	}
+    }
+    for (uint32_t i = 0; i < d->nold; i++) {
+	struct oldPkg *o = &d->old[i];
+	if (o->seen)
+	    continue;
+	const char *name = oldName(o), *end = o->rec + o->size;
+	for (const char *p = name + strlen(name) + 1; p < end; p += strlen(p) + 1)
+	    chg[n++] = (struct change) { name, p, NULL, '-' };
+    }
+    // A file removed from one package and added to another has moved;
+    // the removal is then dropped.
+    for (size_t i = 0; i < n; i++) {
+	if (chg[i].op != '-')
+	    continue;
+	uint64_t h = hashStr(chg[i].file);
+	for (size_t j = h & (nslots - 1); slots[j].id; j = (j + 1) & (nslots - 1)) {
+	    struct change *c = &chg[slots[j].id - 1];
+	    if (slots[j].hash != h || c->from || strcmp(c->file, chg[i].file))
+		continue;
+	    if (strcmp(c->name, chg[i].name)) {
+		c->from = chg[i].name, c->op = 'm';
+		chg[i].op = 0;
+	    }
+	    break;
+	}
+    }
+    int rc = 0;
+    for (size_t i = 0; i < n; i++) {
+	if (!chg[i].op)
+	    continue;
+	if (cb(arg, chg[i].op, chg[i].name, chg[i].file, chg[i].from)) {
+	    err[0] = "pkglistDiffFinish", err[1] = "stopped";
+	    rc = -1;
+	    break;
+	}
+    }
+    free(chg), free(slots);
+    return rc;
+}
+
+// ex:set ts=8 sts=4 sw=4 noet:
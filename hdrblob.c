@@ -0,0 +1,313 @@
+// Copyright (c) 2017 Alexey Tourbin
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include "hdrblob.h"
+
+// The tag types, as in rpmtag.h.
+enum {
+    T_NULL, T_CHAR, T_INT8, T_INT16, T_INT32, T_INT64,
+    T_STRING, T_BIN, T_STRING_ARRAY, T_I18NSTRING,
+};
+
+struct hdrent {
+    uint32_t tag, type, offset, count;
+};
+
+// The region tags, the one in pkglists being HEADERIMMUTABLE (63).
+#define isRegionTag(tag) ((tag) >= 61 && (tag) <= 63)
+
+static inline void getEnt(const void *blob, unsigned i, struct hdrent *e)
+{
+    const uint32_t *p = (const uint32_t *) blob + 2 + 4 * i;
+    e->tag = ntohl(p[0]), e->type = ntohl(p[1]);
+    e->offset = ntohl(p[2]), e->count = ntohl(p[3]);
+}
+
+static inline void putEnt(void *blob, unsigned i, const struct hdrent *e)
+{
+    uint32_t *p = (uint32_t *) blob + 2 + 4 * i;
+    p[0] = htonl(e->tag), p[1] = htonl(e->type);
+    p[2] = htonl(e->offset), p[3] = htonl(e->count);
+}
+
+static inline unsigned hdrIL(const void *blob) { return ntohl(((const uint32_t *) blob)[0]); }
+static inline unsigned hdrDL(const void *blob) { return ntohl(((const uint32_t *) blob)[1]); }
+
+static inline const char *hdrData(const void *blob)
+{
+    return (const char *) blob + 8 + 16 * hdrIL(blob);
+}
+
+static unsigned typeAlign(unsigned type)
+{
+    switch (type) {
+    case T_INT16: return 2;
+    case T_INT32: return 4;
+    case T_INT64: return 8;
+    }
+    return 1;
+}
+
+// The data size, for an entry which points into dl bytes of data.
+static size_t dataSize(const char *data, size_t dl, const struct hdrent *e)
+{
+    if (e->offset >= dl || e->count == 0)
+	return 0;
+    const char *p = data + e->offset, *end = data + dl;
+    size_t size;
+    switch (e->type) {
+    case T_CHAR: case T_INT8: case T_BIN:
+	size = e->count;
+	break;
+    case T_INT16: size = 2 * (size_t) e->count; break;
+    case T_INT32: size = 4 * (size_t) e->count; break;
+    case T_INT64: size = 8 * (size_t) e->count; break;
+    case T_STRING:
+	if (e->count != 1)
+	    return 0;
+	// fall through
+    case T_STRING_ARRAY: case T_I18NSTRING:
+	for (uint32_t i = 0; i < e->count; i++) {
+	    const char *z = memchr(p, '\0', end - p);
+	    if (!z)
+		return 0;
+	    p = z + 1;
+	}
+	return p - (data + e->offset);
+    default:
+	return 0;
+    }
+    return size <= (size_t)(end - p) ? size : 0;
+}
+
+bool hdrblobCheck(const void *blob, size_t blobSize)
+{
+    if (blobSize < 8)
+	return false;
+    size_t il = hdrIL(blob), dl = hdrDL(blob);
+    // The limits are those of librpm, 64K entries and 256M of data.
+    if (il < 1 || il > 0xffff || dl > 0x0fffffff || 8 + 16 * il + dl != blobSize)
+	return false;
+    const char *data = hdrData(blob);
+    for (unsigned i = 0; i < il; i++) {
+	struct hdrent e;
+	getEnt(blob, i, &e);
+	if (e.offset % typeAlign(e.type) || dataSize(data, dl, &e) == 0)
+	    return false;
+    }
+    return true;
+}
+
+bool hdrblobRegion(const void *blob, unsigned *rilp, unsigned *rdlp)
+{
+    unsigned il = hdrIL(blob);
+    struct hdrent e0;
+    getEnt(blob, 0, &e0);
+    if (!isRegionTag(e0.tag) || e0.type != T_BIN || e0.count != 16)
+	return false;
+    // The trailer is an index entry, with the negated size
+    // of the region's index as the offset.
+    uint32_t trailer[4];
+    memcpy(trailer, hdrData(blob) + e0.offset, 16);
+    unsigned ril = -(int32_t) ntohl(trailer[2]) / 16;
+    if (ntohl(trailer[0]) != e0.tag || ril < 1 || ril > il)
+	return false;
+    *rilp = ril, *rdlp = e0.offset + 16;
+    return true;
+}
+
+const void *hdrblobData(const void *blob)
+{
+    return hdrData(blob);
+}
+
+const char *hdrblobString(const void *blob, unsigned tag)
+{
+    unsigned il = hdrIL(blob);
+    for (unsigned i = 0; i < il; i++) {
+	struct hdrent e;
+	getEnt(blob, i, &e);
+	if (e.tag == tag)
+	    return e.type == T_STRING ? hdrData(blob) + e.offset : NULL;
+    }
+    return NULL;
+}
+
+bool hdrblobInt32(const void *blob, unsigned tag, uint32_t *val)
+{
+    unsigned il = hdrIL(blob);
+    for (unsigned i = 0; i < il; i++) {
+	struct hdrent e;
+	getEnt(blob, i, &e);
+	if (e.tag == tag) {
+	    if (e.type != T_INT32)
+		return false;
+	    memcpy(val, hdrData(blob) + e.offset, 4);
+	    *val = ntohl(*val);
+	    return true;
+	}
+    }
+    return false;
+}
+
+const char *hdrblobStrings(const void *blob, unsigned tag, unsigned *countp)
+{
+    unsigned il = hdrIL(blob);
+    for (unsigned i = 0; i < il; i++) {
+	struct hdrent e;
+	getEnt(blob, i, &e);
+	if (e.tag != tag)
+	    continue;
+	if (e.type != T_STRING && e.type != T_STRING_ARRAY && e.type != T_I18NSTRING)
+	    return NULL;
+	*countp = e.count;
+	return hdrData(blob) + e.offset;
+    }
+    return NULL;
+}
+
+const uint32_t *hdrblobInt32s(const void *blob, unsigned tag, unsigned *countp)
+{
+    unsigned il = hdrIL(blob);
+    for (unsigned i = 0; i < il; i++) {
+	struct hdrent e;
+	getEnt(blob, i, &e);
+	if (e.tag != tag)
+	    continue;
+	if (e.type != T_INT32)
+	    return NULL;
+	*countp = e.count;
+	// Aligned, as checked by hdrblobCheck.
+	return (const uint32_t *) (hdrData(blob) + e.offset);
+    }
+    return NULL;
+}
+
+unsigned hdrblobCount(const void *blob, unsigned tag)
+{
+    unsigned il = hdrIL(blob);
+    for (unsigned i = 0; i < il; i++) {
+	struct hdrent e;
+	getEnt(blob, i, &e);
+	if (e.tag == tag)
+	    return e.count;
+    }
+    return 0;
+}
+
+bool hdrblobInt(const void *blob, unsigned tag, uint64_t *val)
+{
+    unsigned il = hdrIL(blob);
+    for (unsigned i = 0; i < il; i++) {
+	struct hdrent e;
+	getEnt(blob, i, &e);
+	if (e.tag != tag)
+	    continue;
+	const unsigned char *p = (const unsigned char *) hdrData(blob) + e.offset;
+	switch (e.type) {
+	case T_CHAR: case T_INT8:
+	    *val = p[0];
+	    return true;
+	case T_INT16: {
+	    uint16_t v;
+	    memcpy(&v, p, 2);
+	    *val = ntohs(v);
+	    return true; }
+	case T_INT32: {
+	    uint32_t v;
+	    memcpy(&v, p, 4);
+	    *val = ntohl(v);
+	    return true; }
+	case T_INT64: {
+	    uint32_t v[2];
+	    memcpy(v, p, 8);
+	    *val = (uint64_t) ntohl(v[0]) << 32 | ntohl(v[1]);
+	    return true; }
+	}
+	return false;
+    }
+    return false;
+}
+
+static int cmpOffset(const void *a, const void *b)
+{
+    const struct hdrent *x = a, *y = b;
+    return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+size_t hdrblobStrip(const void *blob, const int *tags, int ntags, void *out)
+{
+    unsigned il = hdrIL(blob), dl = hdrDL(blob);
+    const char *data = hdrData(blob);
+    // The kept entries, to be sorted by the offset, along with
+    // their new positions in the index.
+    struct { struct hdrent e; unsigned ix; } *ent = malloc(il * sizeof *ent);
+    if (!ent)
+	return 0;
+    unsigned nkept = 0;
+    // The region, with its index entries at the start.
+    unsigned ril = 0, rdl, nrkept = 0;
+    if (!hdrblobRegion(blob, &ril, &rdl))
+	ril = 0;
+    for (unsigned i = 0; i < il; i++) {
+	struct hdrent e;
+	getEnt(blob, i, &e);
+	bool strip = false;
+	for (int j = 0; !strip && j < ntags; j++)
+	    strip = e.tag == (uint32_t) tags[j];
+	if (strip && !(i == 0 && ril))
+	    continue;
+	ent[nkept].e = e, ent[nkept].ix = nkept;
+	nkept++;
+	if (i < ril)
+	    nrkept++;
+    }
+    // Lay out the data in the original order, the region trailer
+    // thereby staying at the end of the region's data.
+    qsort(ent, nkept, sizeof *ent, cmpOffset);
+    char *newData = (char *) out + 8 + 16 * nkept;
+    size_t off = 0;
+    for (unsigned i = 0; i < nkept; i++) {
+	struct hdrent *e = &ent[i].e;
+	size_t size = dataSize(data, dl, e);
+	unsigned align = typeAlign(e->type);
+	while (off % align)
+	    newData[off++] = '\0';
+	memcpy(newData + off, data + e->offset, size);
+	e->offset = off;
+	off += size;
+	putEnt(out, ent[i].ix, e);
+	if (ril && ent[i].ix == 0) {
+	    // The trailer tells the number of entries in the region.
+	    uint32_t roff = htonl(-(int32_t)(16 * nrkept));
+	    memcpy(newData + e->offset + 8, &roff, 4);
+	}
+    }
+    free(ent);
+    ((uint32_t *) out)[0] = htonl(nkept);
+    ((uint32_t *) out)[1] = htonl(off);
+    return 8 + 16 * nkept + off;
+}
+
+// ex:set ts=8 sts=4 sw=4 noet:
@@ -0,0 +1,74 @@
+// Copyright (c) 2017 Alexey Tourbin
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Direct access to the header blobs, as they come out of zpkglist (without
+// the magic), for the cases where loading the header with librpm would be
+// a waste or would not do.  Internal to the library.
+//
+// The blob is the index length il and the data length dl, followed by
+// il index entries and dl bytes of data, all in network byte order.
+// An index entry is the tag, the type, the offset into the data, and
+// the count.  The first entry may be the region tag, which marks the
+// immutable part of the header, as signed by the packager.
+
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Check the blob's layout: the sizes, and the entries pointing into
+// the data.  All the functions below expect a checked blob.
+bool hdrblobCheck(const void *blob, size_t blobSize);
+
+// The region's index entries and data come first in the blob, as laid
+// out by headerExport.  Gets the number of the entries and the size of
+// the data, or returns false if there is no region.
+bool hdrblobRegion(const void *blob, unsigned *rilp, unsigned *rdlp);
+
+// The start of the data, right after the index.
+const void *hdrblobData(const void *blob);
+
+// The value of a STRING tag, pointing into the blob, or NULL.
+const char *hdrblobString(const void *blob, unsigned tag);
+
+// The first value of an INT32 tag, or false if there is no such tag.
+bool hdrblobInt32(const void *blob, unsigned tag, uint32_t *val);
+
+// The values of a STRING_ARRAY tag, or of a STRING tag, as one value:
+// the first of the NUL-terminated strings, pointing into the blob, or NULL.
+const char *hdrblobStrings(const void *blob, unsigned tag, unsigned *countp);
+
+// The values of an INT32 tag, pointing into the blob, still in network
+// byte order, or NULL.
+const uint32_t *hdrblobInt32s(const void *blob, unsigned tag, unsigned *countp);
+
+// The number of values of a tag, or 0 if there is no such tag.
+unsigned hdrblobCount(const void *blob, unsigned tag);
+
+// The first value of an integer tag, of whichever width, or false if
+// there is no such tag or it is not an integer.
+bool hdrblobInt(const void *blob, unsigned tag, uint64_t *val);
+
+// Copy the blob to out, leaving out the entries with the given tags,
+// and lay out the data anew, so that no space is wasted on them.
+// The region, if any, is adjusted (the region tag itself is not stripped).
+// The out buffer must be at least the size of the blob.  Returns the new
+// size, or 0 on malloc failure.
+size_t hdrblobStrip(const void *blob, const int *tags, int ntags, void *out);
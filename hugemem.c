@@ -0,0 +1,72 @@
+// Copyright (c) 2017 Alexey Tourbin
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+// The big long-lived buffers, backed by huge pages where the system allows,
+// which takes the pressure off the TLB when they are streamed through.
+
+#include <stdint.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include "pkglistquery.h"
+
+// The default huge page size on x86-64 and most arm64 kernels, which is
+// what MAP_HUGETLB gets without the size bits.
+#define HUGEPAGE (2 << 20)
+
+static size_t roundUp(size_t size)
+{
+    return (size + HUGEPAGE - 1) & ~(size_t) (HUGEPAGE - 1);
+}
+
+void *pkglistHugeMap(size_t *sizep, bool shared, const char **howp)
+{
+    size_t size = roundUp(*sizep);
+    int flags = (shared ? MAP_SHARED : MAP_PRIVATE) | MAP_ANONYMOUS;
+    // The reserved pages, if any (vm.nr_hugepages), are a sure thing.
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED) {
+	*sizep = size, *howp = "hugetlb";
+	return p;
+    }
+    // Otherwise, the transparent huge pages need an aligned mapping,
+    // so a bigger one is trimmed down.
+    char *q = mmap(NULL, size + HUGEPAGE, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (q == MAP_FAILED)
+	return NULL;
+    size_t head = -(uintptr_t) q & (HUGEPAGE - 1);
+    if (head)
+	munmap(q, head);
+    munmap(q + head + size, HUGEPAGE - head);
+    p = q + head;
+    // The kernel may still not grant them, e.g. with shmem_enabled=never
+    // for the shared memory, in which case the pages stay normal.
+    *sizep = size;
+    *howp = madvise(p, size, MADV_HUGEPAGE) ? "4k" : "thp";
+    return p;
+}
+
+void pkglistHugeUnmap(void *p, size_t size)
+{
+    if (p)
+	munmap(p, size);
+}
+
+// ex:set ts=8 sts=4 sw=4 noet:
@@ -0,0 +1,237 @@
+// Copyright (c) 2017 Alexey Tourbin
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// The first pass of a merge: the keys are taken right from the blobs,
+// and the first source to have a key owns it.  The winners are recorded
+// as a bitmap per source, for pkglistQueryFdMerged.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <assert.h>
+#include <unistd.h>
+#include <rpm/rpmlib.h>
+#include <zpkglist.h>
+#include "pkglistquery.h"
+#include "hdrblob.h"
+#include "xstrerror.h"
+
+// A hash table slot: the key is in the arena, at the offset.
+struct slot {
+    uint64_t hash;
+    uint32_t off;
+    uint32_t src; // 0 if the slot is empty, the source + 1 otherwise
+};
+
+struct source {
+    size_t n;
+    unsigned char *keep;
+};
+
+struct pkglistMerge {
+    int key;
+    // Open addressing, at most half full.
+    size_t nslots, nkeys;
+    struct slot *slots;
+    char *arena;
+    size_t arenaSize, arenaAlloc;
+    int nsrc;
+    struct source *src;
+};
+
+struct pkglistMerge *pkglistMergeNew(int key, const char *err[2])
+{
+    struct pkglistMerge *m = calloc(1, sizeof *m);
+    if (m) {
+	m->key = key;
+	m->nslots = 1 << 12;
+	m->slots = calloc(m->nslots, sizeof *m->slots);
+	if (m->slots)
+	    return m;
+	free(m);
+    }
+    err[0] = "calloc", err[1] = xstrerror(ENOMEM);
+    return NULL;
+}
+
+void pkglistMergeFree(struct pkglistMerge *m)
+{
+    if (!m)
+	return;
+    for (int i = 0; i < m->nsrc; i++)
+	free(m->src[i].keep);
+    free(m->src);
+    free(m->slots);
+    free(m->arena);
+    free(m);
+}
+
+// FNV-1a, good enough with the table at most half full.
+static uint64_t hashKey(const char *s, size_t len)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++)
+	h = (h ^ (unsigned char) s[i]) * 0x100000001b3ULL;
+    return h;
+}
+
+static bool grow(struct pkglistMerge *m)
+{
+    size_t nslots = 2 * m->nslots;
+    struct slot *slots = calloc(nslots, sizeof *slots);
+    if (!slots)
+	return false;
+    for (size_t i = 0; i < m->nslots; i++) {
+	struct slot *s = &m->slots[i];
+	if (!s->src)
+	    continue;
+	size_t j = s->hash & (nslots - 1);
+	while (slots[j].src)
+	    j = (j + 1) & (nslots - 1);
+	slots[j] = *s;
+    }
+    free(m->slots);
+    m->slots = slots, m->nslots = nslots;
+    return true;
+}
+
+// Look up the key, adding it for the source if it is new.  Returns
+// the key's source, or -1 on malloc failure.
+static int lookup(struct pkglistMerge *m, const char *key, size_t len, int src)
+{
+    uint64_t h = hashKey(key, len);
+    size_t j = h & (m->nslots - 1);
+    for (struct slot *s; (s = &m->slots[j])->src; j = (j + 1) & (m->nslots - 1))
+	if (s->hash == h && strcmp(m->arena + s->off, key) == 0)
+	    return s->src - 1;
+    if (m->arenaSize + len + 1 > m->arenaAlloc) {
+	size_t alloc = m->arenaAlloc ? 2 * m->arenaAlloc : 1 << 16;
+	while (alloc < m->arenaSize + len + 1)
+	    alloc *= 2;
+	char *arena = realloc(m->arena, alloc);
+	if (!arena)
+	    return -1;
+	m->arena = arena, m->arenaAlloc = alloc;
+    }
+    memcpy(m->arena + m->arenaSize, key, len + 1);
+    m->slots[j] = (struct slot) { h, m->arenaSize, src + 1 };
+    m->arenaSize += len + 1;
+    if (++m->nkeys > m->nslots / 2 && !grow(m))
+	return -1;
+    return src;
+}
+
+// The merge key: either the name, or the full N-E:V-R.A.
+static size_t makeKey(struct pkglistMerge *m, const void *blob, char *buf, size_t size)
+{
+    const char *name = hdrblobString(blob, RPMTAG_NAME);
+    if (!name)
+	return 0;
+    if (m->key == PKGLIST_MERGE_NAME)
+	return snprintf(buf, size, "%s", name);
+    const char *v = hdrblobString(blob, RPMTAG_VERSION);
+    const char *r = hdrblobString(blob, RPMTAG_RELEASE);
+    const char *a = hdrblobString(blob, RPMTAG_ARCH);
+    uint32_t e;
+    if (!v || !r)
+	return 0;
+    if (hdrblobInt32(blob, RPMTAG_EPOCH, &e))
+	return snprintf(buf, size, "%s-%u:%s-%s.%s", name, (unsigned) e, v, r, a ? a : "");
+    return snprintf(buf, size, "%s-%s-%s.%s", name, v, r, a ? a : "");
+}
+
+static __thread char errbuf[256];
+
+ssize_t pkglistMergeScan(struct pkglistMerge *m, int fd, const char *err[2])
+{
+    struct source *src = realloc(m->src, (m->nsrc + 1) * sizeof *src);
+    if (!src) {
+	close(fd);
+	err[0] = "realloc", err[1] = xstrerror(ENOMEM);
+	return -1;
+    }
+    m->src = src;
+    src = &m->src[m->nsrc];
+    *src = (struct source) { 0, NULL };
+    int isrc = m->nsrc++;
+    size_t alloc = 0;
+    char key[1024];
+    struct zpkglistReader *z;
+    const char *func = "zpkglistFdopen";
+    ssize_t ret = zpkglistFdopen(&z, fd, err);
+    if (ret > 0) {
+	void *blob;
+	func = "zpkglistNextMalloc";
+	while ((ret = zpkglistNextMalloc(z, &blob, NULL, false, err)) > 0) {
+	    size_t len = 0;
+	    if (hdrblobCheck(blob, ret))
+		len = makeKey(m, blob, key, sizeof key);
+	    free(blob);
+	    if (len == 0 || len >= sizeof key) {
+		err[0] = "pkglistMergeScan", err[1] = "bad header";
+		ret = -1, func = NULL;
+		break;
+	    }
+	    if (src->n == 8 * alloc) {
+		size_t old = alloc;
+		alloc = alloc ? 2 * alloc : 1024;
+		unsigned char *keep = realloc(src->keep, alloc);
+		if (!keep) {
+		    err[0] = "realloc", err[1] = xstrerror(ENOMEM);
+		    ret = -1, func = NULL;
+		    break;
+		}
+		memset(keep + old, 0, alloc - old);
+		src->keep = keep;
+	    }
+	    int owner = lookup(m, key, len, isrc);
+	    if (owner < 0) {
+		err[0] = "malloc", err[1] = xstrerror(ENOMEM);
+		ret = -1, func = NULL;
+		break;
+	    }
+	    if (owner == isrc)
+		src->keep[src->n / 8] |= 1 << (src->n % 8);
+	    src->n++;
+	}
+	zpkglistFree(z);
+    }
+    close(fd);
+    if (ret < 0) {
+	if (func && strcmp(func, err[0]) && strncmp(err[0], "zpkglist", 8)) {
+	    snprintf(errbuf, sizeof errbuf, "%s: %s", func, err[0]);
+	    err[0] = errbuf;
+	}
+	return -1;
+    }
+    return src->n;
+}
+
+const unsigned char *pkglistMergeKeep(struct pkglistMerge *m, int src, size_t *np)
+{
+    assert(src >= 0 && src < m->nsrc);
+    *np = m->src[src].n;
+    return m->src[src].keep;
+}
+
+// ex:set ts=8 sts=4 sw=4 noet:
@@ -0,0 +1,457 @@
+// Copyright (c) 2017 Alexey Tourbin
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Each worker process is connected to the parent with two byte rings in
+// shared memory: the blobs go down one ring, and the strings come back up
+// the other.  Each ring has a single producer and a single consumer, so it
+// needs no locks, only the head and tail counters.  A record in the ring
+// is a header followed by the payload, which is streamed through the ring
+// in pieces if it does not fit.  The parent remembers which worker got
+// which blob, and reads the results back in the original order.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "mproc.h"
+#include "xstrerror.h"
+
+// The ring size, a power of two.  The memory is only touched as needed.
+#define RINGSIZE (4 << 20)
+
+// The counters wrap around, head - tail being the number of bytes in use.
+// The waiting side raises its flag, so that the other side knows to issue
+// the wake-up call.
+struct ring {
+    uint32_t head __attribute__((aligned(64)));
+    uint32_t cwait; // the consumer waits for the head to move
+    uint32_t tail __attribute__((aligned(64)));
+    uint32_t pwait; // the producer waits for the tail to move
+    char buf[RINGSIZE] __attribute__((aligned(64)));
+};
+
+// The record header.  A blob of size ENDBLOB tells the worker to exit.
+struct rec {
+    uint32_t size;
+    uint32_t status; // for the results: 0 on success, or the error strings
+};
+
+#define ENDBLOB UINT32_MAX
+
+struct worker {
+    pid_t pid;
+    bool reaped;
+    unsigned pending;
+    struct ring *in, *out;
+    size_t mapSize;
+};
+
+// The error strings must outlive the handle.
+static __thread char errbuf0[64], errbuf1[256];
+
+// The order of the blobs in flight, by the worker.
+#define MAXINFLIGHT 4096
+
+struct mproc {
+    int nproc;
+    pkglistQueryJob job;
+    void *jobArg;
+    pkglistQueryCallback cb;
+    void *cbArg;
+    bool stopped;
+    const char *err[2];
+    // The results are copied out of the ring into this buffer.
+    char *buf;
+    size_t bufSize;
+    unsigned ohead, ninflight;
+    unsigned short owner[MAXINFLIGHT];
+    struct worker w[];
+};
+
+static void futex(uint32_t *addr, int op, uint32_t val)
+{
+    // The timeout lets the parent check for dead workers.
+    struct timespec ts = { 0, 100 * 1000 * 1000 };
+    syscall(SYS_futex, addr, op, val, op == FUTEX_WAIT ? &ts : NULL, NULL, 0);
+}
+
+// Copy out as much as there is space for, returns the number of bytes.
+static size_t ringPut(struct ring *r, const char *data, size_t n)
+{
+    uint32_t head = r->head;
+    uint32_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    size_t space = RINGSIZE - (uint32_t)(head - tail);
+    if (n > space)
+	n = space;
+    if (n == 0)
+	return 0;
+    size_t off = head & (RINGSIZE - 1);
+    size_t k = RINGSIZE - off < n ? RINGSIZE - off : n;
+    memcpy(r->buf + off, data, k);
+    memcpy(r->buf, data + k, n - k);
+    __atomic_store_n(&r->head, head + n, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&r->cwait, __ATOMIC_SEQ_CST))
+	futex(&r->head, FUTEX_WAKE, 1);
+    return n;
+}
+
+static size_t ringGet(struct ring *r, char *data, size_t n)
+{
+    uint32_t tail = r->tail;
+    uint32_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    size_t avail = (uint32_t)(head - tail);
+    if (n > avail)
+	n = avail;
+    if (n == 0)
+	return 0;
+    size_t off = tail & (RINGSIZE - 1);
+    size_t k = RINGSIZE - off < n ? RINGSIZE - off : n;
+    memcpy(data, r->buf + off, k);
+    memcpy(data + k, r->buf, n - k);
+    __atomic_store_n(&r->tail, tail + n, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&r->pwait, __ATOMIC_SEQ_CST))
+	futex(&r->tail, FUTEX_WAKE, 1);
+    return n;
+}
+
+// Wait for the other side to move the counter, or for the timeout.
+static void ringWait(uint32_t *counter, uint32_t *flag, uint32_t val)
+{
+    __atomic_store_n(flag, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(counter, __ATOMIC_SEQ_CST) == val)
+	futex(counter, FUTEX_WAIT, val);
+    __atomic_store_n(flag, 0, __ATOMIC_SEQ_CST);
+}
+
+// The worker side, blocking; the worker is killed if the parent dies.
+static void putAll(struct ring *r, const void *data, size_t n)
+{
+    const char *p = data;
+    while (n) {
+	uint32_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+	size_t k = ringPut(r, p, n);
+	if (k == 0)
+	    ringWait(&r->tail, &r->pwait, tail);
+	p += k, n -= k;
+    }
+}
+
+static void getAll(struct ring *r, void *data, size_t n)
+{
+    char *p = data;
+    while (n) {
+	uint32_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	size_t k = ringGet(r, p, n);
+	if (k == 0)
+	    ringWait(&r->head, &r->cwait, head);
+	p += k, n -= k;
+    }
+}
+
+static void __attribute__((noreturn)) workerMain(struct mproc *mp, struct worker *w)
+{
+    while (1) {
+	struct rec rec;
+	getAll(w->in, &rec, sizeof rec);
+	if (rec.size == ENDBLOB)
+	    _exit(0);
+	void *blob = malloc(rec.size ? rec.size : 1);
+	if (!blob)
+	    _exit(2);
+	getAll(w->in, blob, rec.size);
+	size_t len = 0;
+	const char *err[2] = { "job", "failed" };
+	char *str = mp->job(blob, rec.size, mp->jobArg, &len, err);
+	if (str) {
+	    rec = (struct rec) { len, 0 };
+	    putAll(w->out, &rec, sizeof rec);
+	    putAll(w->out, str, len);
+	    free(str);
+	}
+	else {
+	    // The error strings are sent over as "err0\0err1\0".
+	    size_t len0 = strlen(err[0]) + 1, len1 = strlen(err[1]) + 1;
+	    rec = (struct rec) { len0 + len1, 1 };
+	    putAll(w->out, &rec, sizeof rec);
+	    putAll(w->out, err[0], len0);
+	    putAll(w->out, err[1], len1);
+	}
+    }
+}
+
+static bool fail(struct mproc *mp, const char *func, const char *msg, const char *err[2])
+{
+    if (!mp->stopped) {
+	mp->stopped = true;
+	mp->err[0] = func, mp->err[1] = msg;
+    }
+    err[0] = mp->err[0], err[1] = mp->err[1];
+    return false;
+}
+
+// Called when the parent has waited for a worker: the worker may be dead.
+static bool checkWorker(struct mproc *mp, struct worker *w, const char *err[2])
+{
+    int status;
+    pid_t pid = waitpid(w->pid, &status, WNOHANG);
+    if (pid == 0)
+	return true;
+    w->reaped = true;
+    if (pid < 0)
+	return fail(mp, "waitpid", xstrerror(errno), err);
+    if (WIFSIGNALED(status))
+	snprintf(errbuf1, sizeof errbuf1, "worker process %d killed by signal %d",
+		(int) w->pid, WTERMSIG(status));
+    else
+	snprintf(errbuf1, sizeof errbuf1, "worker process %d exited with status %d",
+		(int) w->pid, WEXITSTATUS(status));
+    return fail(mp, "worker", errbuf1, err);
+}
+
+// The parent side, which also checks the worker while waiting.
+static bool parentGet(struct mproc *mp, struct worker *w, void *data, size_t n,
+	const char *err[2])
+{
+    char *p = data;
+    while (n) {
+	uint32_t head = __atomic_load_n(&w->out->head, __ATOMIC_ACQUIRE);
+	size_t k = ringGet(w->out, p, n);
+	if (k == 0) {
+	    ringWait(&w->out->head, &w->out->cwait, head);
+	    if (__atomic_load_n(&w->out->head, __ATOMIC_ACQUIRE) == head &&
+		    !checkWorker(mp, w, err))
+		return false;
+	}
+	p += k, n -= k;
+    }
+    return true;
+}
+
+// Read back the result of the oldest blob in flight, blocking,
+// and pass it to the callback.
+static bool emitOne(struct mproc *mp, const char *err[2])
+{
+    struct worker *w = &mp->w[mp->owner[mp->ohead]];
+    struct rec rec;
+    if (!parentGet(mp, w, &rec, sizeof rec, err))
+	return false;
+    if (rec.size + 1 > mp->bufSize) {
+	size_t size = mp->bufSize ? mp->bufSize : 4096;
+	while (size < rec.size + 1)
+	    size *= 2;
+	char *buf = realloc(mp->buf, size);
+	if (!buf)
+	    return fail(mp, "realloc", xstrerror(ENOMEM), err);
+	mp->buf = buf, mp->bufSize = size;
+    }
+    if (!parentGet(mp, w, mp->buf, rec.size, err))
+	return false;
+    mp->buf[rec.size] = '\0';
+    mp->ohead = (mp->ohead + 1) % MAXINFLIGHT;
+    mp->ninflight--;
+    w->pending--;
+    if (rec.status) {
+	snprintf(errbuf0, sizeof errbuf0, "%s", mp->buf);
+	snprintf(errbuf1, sizeof errbuf1, "%s", mp->buf + strlen(mp->buf) + 1);
+	return fail(mp, errbuf0, errbuf1, err);
+    }
+    if (mp->cb(mp->cbArg, mp->buf, rec.size))
+	return fail(mp, "callback", "query stopped", err);
+    return true;
+}
+
+// Whether the result of the oldest blob in flight is there to read without
+// waiting on the job: the worker only writes the record once the job is
+// done, and the rest of it then follows.
+static bool oldestReady(struct mproc *mp)
+{
+    struct worker *w = &mp->w[mp->owner[mp->ohead]];
+    uint32_t head = __atomic_load_n(&w->out->head, __ATOMIC_ACQUIRE);
+    return (uint32_t)(head - w->out->tail) >= sizeof(struct rec);
+}
+
+// Writing to a full ring, the parent has to make progress on the output
+// side: the worker may be stuck with its own results ring full.  Reading
+// the oldest result always makes progress, unless that is the very blob
+// being written, which the worker is consuming anyway.
+static bool parentPut(struct mproc *mp, struct worker *w, const void *data, size_t n,
+	const char *err[2])
+{
+    const char *p = data;
+    while (n) {
+	uint32_t tail = __atomic_load_n(&w->in->tail, __ATOMIC_ACQUIRE);
+	size_t k = ringPut(w->in, p, n);
+	p += k, n -= k;
+	if (n == 0 || k > 0)
+	    continue;
+	if (mp->ninflight > 1) {
+	    if (!emitOne(mp, err))
+		return false;
+	    continue;
+	}
+	ringWait(&w->in->tail, &w->in->pwait, tail);
+	if (__atomic_load_n(&w->in->tail, __ATOMIC_ACQUIRE) == tail &&
+		!checkWorker(mp, w, err))
+	    return false;
+    }
+    return true;
+}
+
+static void killWorkers(struct mproc *mp)
+{
+    for (int i = 0; i < mp->nproc; i++) {
+	struct worker *w = &mp->w[i];
+	if (w->pid > 0 && !w->reaped) {
+	    kill(w->pid, SIGKILL);
+	    waitpid(w->pid, NULL, 0);
+	    w->reaped = true;
+	}
+    }
+}
+
+static void freeMproc(struct mproc *mp)
+{
+    for (int i = 0; i < mp->nproc; i++)
+	if (mp->w[i].in)
+	    munmap(mp->w[i].in, mp->w[i].mapSize);
+    free(mp->buf);
+    free(mp);
+}
+
+struct mproc *mprocStart(int nproc, bool huge, pkglistQueryJob job, void *jobArg,
+	pkglistQueryCallback cb, void *cbArg, const char *err[2])
+{
+    struct mproc *mp = calloc(1, sizeof *mp + nproc * sizeof mp->w[0]);
+    if (!mp) {
+	err[0] = "calloc", err[1] = xstrerror(ENOMEM);
+	return NULL;
+    }
+    mp->nproc = nproc;
+    mp->job = job, mp->jobArg = jobArg;
+    mp->cb = cb, mp->cbArg = cbArg;
+    pid_t parent = getpid();
+    for (int i = 0; i < nproc; i++) {
+	struct worker *w = &mp->w[i];
+	struct ring *r;
+	size_t size = 2 * sizeof *r;
+	if (huge) {
+	    const char *how;
+	    r = pkglistHugeMap(&size, true, &how);
+	}
+	else
+	    r = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (!r || r == MAP_FAILED) {
+	    err[0] = "mmap", err[1] = xstrerror(errno);
+	    goto fail;
+	}
+	w->in = r, w->out = r + 1, w->mapSize = size;
+	w->pid = fork();
+	if (w->pid < 0) {
+	    err[0] = "fork", err[1] = xstrerror(errno);
+	    goto fail;
+	}
+	if (w->pid == 0) {
+	    prctl(PR_SET_PDEATHSIG, SIGKILL);
+	    if (getppid() != parent)
+		_exit(2);
+	    workerMain(mp, w);
+	}
+    }
+    return mp;
+fail:
+    killWorkers(mp);
+    freeMproc(mp);
+    return NULL;
+}
+
+bool mprocBlob(struct mproc *mp, void *blob, unsigned blobSize, const char *err[2])
+{
+    if (mp->stopped) {
+	free(blob);
+	return fail(mp, NULL, NULL, err);
+    }
+    // The results which are ready go out now, not to be held back
+    // by a slow feeder.
+    while (mp->ninflight && oldestReady(mp))
+	if (!emitOne(mp, err)) {
+	    free(blob);
+	    return false;
+	}
+    if (mp->ninflight == MAXINFLIGHT && !emitOne(mp, err)) {
+	free(blob);
+	return false;
+    }
+    // The worker with the fewest blobs in flight.
+    int i = 0;
+    for (int j = 1; j < mp->nproc; j++)
+	if (mp->w[j].pending < mp->w[i].pending)
+	    i = j;
+    struct worker *w = &mp->w[i];
+    mp->owner[(mp->ohead + mp->ninflight) % MAXINFLIGHT] = i;
+    mp->ninflight++;
+    w->pending++;
+    struct rec rec = { blobSize, 0 };
+    bool ok = parentPut(mp, w, &rec, sizeof rec, err) &&
+	      parentPut(mp, w, blob, blobSize, err);
+    free(blob);
+    return ok;
+}
+
+bool mprocFinish(struct mproc *mp, const char *err[2])
+{
+    bool ok = !mp->stopped;
+    while (ok && mp->ninflight)
+	ok = emitOne(mp, err);
+    if (ok) {
+	struct rec rec = { ENDBLOB, 0 };
+	for (int i = 0; ok && i < mp->nproc; i++)
+	    ok = parentPut(mp, &mp->w[i], &rec, sizeof rec, err);
+    }
+    for (int i = 0; ok && i < mp->nproc; i++) {
+	struct worker *w = &mp->w[i];
+	int status;
+	if (waitpid(w->pid, &status, 0) < 0)
+	    ok = fail(mp, "waitpid", xstrerror(errno), err);
+	else {
+	    w->reaped = true;
+	    if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+		snprintf(errbuf1, sizeof errbuf1, "worker process %d failed",
+			(int) w->pid);
+		ok = fail(mp, "worker", errbuf1, err);
+	    }
+	}
+    }
+    if (!ok)
+	fail(mp, NULL, NULL, err);
+    killWorkers(mp);
+    freeMproc(mp);
+    return ok;
+}
+
+// ex:set ts=8 sts=4 sw=4 noet:
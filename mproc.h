@@ -0,0 +1,41 @@
+// Copyright (c) 2017 Alexey Tourbin
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// The workers as forked processes, an alternative to the job queue which
+// sidesteps the locks inside librpm and malloc.  Internal to the library.
+
+#pragma once
+#include <stdbool.h>
+#include "pkglistquery.h"
+
+struct mproc;
+
+// Fork the worker processes, which will run the job.  With huge, the rings
+// are backed by huge pages, see pkglistHugeMap.  Returns NULL on error.
+struct mproc *mprocStart(int nproc, bool huge, pkglistQueryJob job, void *jobArg,
+	pkglistQueryCallback cb, void *cbArg, const char *err[2]);
+
+// Dispatch the blob to a worker; the blob is freed.  The results which
+// are ready are passed to the callback.  Returns false on error.
+bool mprocBlob(struct mproc *mp, void *blob, unsigned blobSize, const char *err[2]);
+
+// Pass the remaining results to the callback, reap the workers,
+// and free the resources.  Returns false on error.
+bool mprocFinish(struct mproc *mp, const char *err[2]);
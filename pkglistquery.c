@@ -0,0 +1,1574 @@
+// Copyright (c) 2017 Alexey Tourbin
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#define PROG "pkglistquery"
+#include "queue.h"
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <fnmatch.h>
+#include <strings.h>
+#include <arpa/inet.h>
+#include <rpm/rpmlib.h>
+#include <rpm/rpmpgp.h>
+#include <zpkglist.h>
+#include "pkglistquery.h"
+#include "mproc.h"
+#include "hdrblob.h"
+#include "dedup.h"
+
+_Static_assert(MAXTHREADS == PKGLISTQUERY_MAXTHREADS, "MAXTHREADS");
+
+// With pkglistQueryEnableStats, the librpm calls are timed on each thread,
+// both the wall clock and the thread's CPU time: the difference is the time
+// spent off the CPU, which, with enough cores, is mostly waiting on locks.
+enum { CALL_IMPORT, CALL_FORMAT, CALL_FREE, NCALLS };
+static const char *callNames[NCALLS] = {
+    "headerImport", "headerFormat", "headerFree",
+};
+
+struct callStats {
+    uint64_t calls;
+    uint64_t wallNs, cpuNs;
+};
+
+// Also, the memory held at each stage of the pipeline is accounted for:
+// the blobs, from the decoder until a worker takes them; the headers, while
+// loaded, by an estimate of what librpm holds for them; and the results,
+// from the job until the sink takes them, which includes waiting in the
+// queue for the earlier ones.  The current and the peak bytes are kept
+// per stage, the allocations per thread.
+enum { MEM_BLOB, MEM_HEADER, MEM_RESULT, NMEMS };
+static const char *memNames[NMEMS] = {
+    "blobs", "headers", "results",
+};
+
+struct memStats {
+    uint64_t allocs, bytes;
+};
+
+struct threadStats {
+    struct callStats call[NCALLS];
+    struct memStats mem[NMEMS];
+    // The headers loaded by the thread.
+    int64_t headerMem, headerPeak;
+};
+
+// A pkglistQueryWhere condition: the tag is formatted as "[%{TAG}\n]",
+// and each line is matched against the glob.
+struct where {
+    char *fmt;
+    char *glob;
+};
+
+struct pkglistQuery {
+    struct queue Q;
+    bool started, finished;
+    bool stats;
+    // With pkglistQueryUseProcesses, the queue is not used.
+    bool procs;
+    bool huge;
+    struct mproc *mp;
+    // The workers and the feeder thread get a slot each, on the first call;
+    // the thread remembers it by the serial, which, unlike the address of
+    // the query, is not reused by the next one.
+    unsigned statsSerial;
+    int nslots;
+    struct threadStats slot[MAXTHREADS+1];
+    int64_t memCur[NMEMS], memPeak[NMEMS];
+    // The job and its argument, for pkglistQueryNew, the format.
+    pkglistQueryJob job;
+    void *jobArg;
+    pkglistQueryCallback cb;
+    void *cbArg;
+    // With pkglistQueryNewRaw, the blobs are passed through.
+    bool raw;
+    int nstrip;
+    int *strip;
+    int nwhere;
+    struct where *where;
+    // With pkglistQueryTop, the winners are only formatted at the finish.
+    struct top *top;
+    // With pkglistQueryDedup, the blobs and the results are tagged.
+    struct dedup *dedup;
+    // With pkglistQueryTrace, the blobs are wrapped.
+    FILE *trace;
+    unsigned traceOrd;
+    // For pkglistQueryPrintProgress, updated with relaxed stores by the
+    // feeder and by the sink, respectively.
+    uint64_t startNs;
+    uint64_t nfed, fedBytes;
+    uint64_t ndone;
+    // With pkglistQueryOutputFd, the file, the offset of the next result,
+    // and the first error of the writes.
+    bool output;
+    int outFd;
+    uint64_t outOff;
+    int writeErrno;
+    char fmt[];
+};
+
+struct stamp {
+    uint64_t wall, cpu;
+};
+
+static inline void stamp(struct stamp *t)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    t->wall = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    t->cpu = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Account for the call which started at t, and restart t.
+static inline void account(struct callStats *c, struct stamp *t)
+{
+    struct stamp t1;
+    stamp(&t1);
+    c->calls++;
+    c->wallNs += t1.wall - t->wall;
+    c->cpuNs += t1.cpu - t->cpu;
+    *t = t1;
+}
+
+static unsigned statsSerial;
+static __thread unsigned slotSerial;
+static __thread struct threadStats *slotStats;
+
+static struct threadStats *threadStats(struct pkglistQuery *q)
+{
+    if (slotSerial == q->statsSerial)
+	return slotStats;
+    int i = __atomic_fetch_add(&q->nslots, 1, __ATOMIC_RELAXED);
+    assert(i < MAXTHREADS + 1);
+    slotSerial = q->statsSerial;
+    return slotStats = &q->slot[i];
+}
+
+// The thread is passed as NULL if it is not the one which made the
+// allocation, e.g. the blobs are allocated by the feeder.
+static void memAlloc(struct pkglistQuery *q, struct threadStats *ts, int what, size_t size)
+{
+    ts->mem[what].allocs++;
+    ts->mem[what].bytes += size;
+    if (what == MEM_HEADER && (ts->headerMem += size) > ts->headerPeak)
+	ts->headerPeak = ts->headerMem;
+    int64_t cur = __atomic_add_fetch(&q->memCur[what], size, __ATOMIC_RELAXED);
+    int64_t peak = __atomic_load_n(&q->memPeak[what], __ATOMIC_RELAXED);
+    while (cur > peak && !__atomic_compare_exchange_n(&q->memPeak[what], &peak, cur,
+		true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+	;
+}
+
+static void memFree(struct pkglistQuery *q, struct threadStats *ts, int what, size_t size)
+{
+    if (ts && what == MEM_HEADER)
+	ts->headerMem -= size;
+    __atomic_sub_fetch(&q->memCur[what], size, __ATOMIC_RELAXED);
+}
+
+// What librpm holds for a header loaded from the blob: the blob itself,
+// which HEADERIMPORT_FAST keeps, and an index entry for each tag, of
+// about 32 bytes.  Must be called before the blob is passed on.
+static size_t headerMem(const void *blob, unsigned blobSize)
+{
+    uint32_t il = 0;
+    if (blobSize >= 8)
+	memcpy(&il, blob, sizeof il);
+    return blobSize + 32 * (size_t) ntohl(il);
+}
+
+// The header magic, which precedes each blob in a pkglist file.
+static const unsigned char magic[8] = { 0x8e, 0xad, 0xe8, 0x01, 0, 0, 0, 0 };
+
+// The result for a header which yields no output.
+static char *emptyResult(size_t *lenp, const char *err[2])
+{
+    char *str = malloc(1);
+    if (!str) {
+	err[0] = "malloc", err[1] = xstrerror(ENOMEM);
+	return NULL;
+    }
+    *str = '\0', *lenp = 0;
+    return str;
+}
+
+// Check the pkglistQueryWhere conditions, all of them must match.
+static bool where(struct pkglistQuery *q, Header h, const char *err[2])
+{
+    for (int i = 0; i < q->nwhere; i++) {
+	const char *fmterr = "format failed";
+	char *str = headerFormat(h, q->where[i].fmt, &fmterr);
+	if (!str) {
+	    err[0] = "headerFormat", err[1] = fmterr;
+	    return false;
+	}
+	bool match = false;
+	for (char *line = str, *nl; !match && (nl = strchr(line, '\n')); line = nl + 1) {
+	    *nl = '\0';
+	    match = fnmatch(q->where[i].glob, line, 0) == 0;
+	}
+	free(str);
+	if (!match)
+	    return false;
+    }
+    return true;
+}
+
+// The job for pkglistQueryNew: load the header blob and format the string.
+// Also the job for pkglistQueryNewRaw, the blob being copied out beforehand.
+static char *formatBlob(void *blob, unsigned blobSize, void *arg,
+			size_t *lenp, const char *err[2])
+{
+    struct pkglistQuery *q = arg;
+    char *rec = NULL;
+    if (q->raw) {
+	rec = malloc(sizeof magic + blobSize);
+	if (!rec) {
+	    err[0] = "malloc", err[1] = xstrerror(ENOMEM);
+	    return NULL;
+	}
+	memcpy(rec, magic, sizeof magic);
+	if (q->nstrip) {
+	    size_t size = 0;
+	    if (!hdrblobCheck(blob, blobSize))
+		err[0] = "hdrblobCheck", err[1] = "malformed header";
+	    else if (!(size = hdrblobStrip(blob, q->strip, q->nstrip, rec + sizeof magic)))
+		err[0] = "malloc", err[1] = xstrerror(ENOMEM);
+	    if (!size) {
+		free(rec);
+		free(blob);
+		return NULL;
+	    }
+	    *lenp = sizeof magic + size;
+	}
+	else {
+	    memcpy(rec + sizeof magic, blob, blobSize);
+	    *lenp = sizeof magic + blobSize;
+	}
+	if (q->nwhere == 0) {
+	    free(blob);
+	    return rec;
+	}
+    }
+    struct threadStats *ts = q->stats ? threadStats(q) : NULL;
+    size_t hmem = ts ? headerMem(blob, blobSize) : 0;
+    struct stamp t = { 0, 0 };
+    if (ts) stamp(&t);
+    Header h = headerImport(blob, blobSize, HEADERIMPORT_FAST);
+    if (ts) account(&ts->call[CALL_IMPORT], &t);
+    if (!h) {
+	// Whether the blob is freed on failure depends on the rpm version,
+	// it is not freed here, the query being stopped anyway.
+	free(rec);
+	err[0] = "headerImport", err[1] = "import failed";
+	return NULL;
+    }
+    if (ts) memAlloc(q, ts, MEM_HEADER, hmem);
+    if (q->nwhere) {
+	err[0] = NULL;
+	bool match = where(q, h, err);
+	if (ts) account(&ts->call[CALL_FORMAT], &t);
+	if (!match) {
+	    headerFree(h);
+	    if (ts) account(&ts->call[CALL_FREE], &t);
+	    if (ts) memFree(q, ts, MEM_HEADER, hmem);
+	    free(rec);
+	    if (err[0])
+		return NULL;
+	    // The header is filtered out, the result is empty.
+	    return emptyResult(lenp, err);
+	}
+    }
+    if (rec) {
+	headerFree(h);
+	if (ts) account(&ts->call[CALL_FREE], &t);
+	if (ts) memFree(q, ts, MEM_HEADER, hmem);
+	return rec;
+    }
+    const char *fmterr = "format failed";
+    char *str = headerFormat(h, q->fmt, &fmterr);
+    if (ts) account(&ts->call[CALL_FORMAT], &t);
+    // The blob is freed on behalf of headerFree.
+    headerFree(h);
+    if (ts) account(&ts->call[CALL_FREE], &t);
+    if (ts) memFree(q, ts, MEM_HEADER, hmem);
+    if (!str) {
+	err[0] = "headerFormat", err[1] = fmterr;
+	return NULL;
+    }
+    *lenp = strlen(str);
+    return str;
+}
+
+// With pkglistQueryTop, each thread keeps the best k headers it has seen
+// in a min-heap, the worst of them on top, so that most of the headers
+// are turned down right on the blob, without being loaded.  The headers
+// are ranked by the key, then by their ordinal, which is passed along
+// with the blob: this way, the result does not depend on which thread
+// got which header.
+struct topEnt {
+    uint64_t num;
+    char *str; // with a STRING tag, the value instead of num
+    uint64_t ord;
+    Header h;
+    size_t mem; // headerMem, with the stats
+};
+
+// The heap grows up to k entries as the headers come, so that a big k
+// costs nothing up front, on each of the threads.
+struct topHeap {
+    unsigned n, alloc;
+    struct topEnt *ent;
+};
+
+struct top {
+    unsigned k;
+    int tag;
+    bool count;
+    // Tells the heaps of this query from those of the previous ones.
+    unsigned serial;
+    // The ordinals, assigned by the feeder.
+    uint64_t ord;
+    int nheaps;
+    struct topHeap heap[MAXTHREADS+1];
+};
+
+// Returns a positive value if a ranks better than b.  The numbers
+// rank above the strings, should a tag have both.
+static int topCmp(const struct topEnt *a, const struct topEnt *b)
+{
+    if (!a->str != !b->str)
+	return a->str ? -1 : 1;
+    int c = a->str ? strcmp(a->str, b->str) : (a->num > b->num) - (a->num < b->num);
+    if (c)
+	return c;
+    return (a->ord < b->ord) - (a->ord > b->ord);
+}
+
+static void topSiftDown(struct topEnt *ent, unsigned n, unsigned i)
+{
+    struct topEnt e = ent[i];
+    for (unsigned c; (c = 2 * i + 1) < n; i = c) {
+	if (c + 1 < n && topCmp(&ent[c + 1], &ent[c]) < 0)
+	    c++;
+	if (topCmp(&ent[c], &e) >= 0)
+	    break;
+	ent[i] = ent[c];
+    }
+    ent[i] = e;
+}
+
+static void topSiftUp(struct topEnt *ent, unsigned i)
+{
+    struct topEnt e = ent[i];
+    for (unsigned p; i > 0 && topCmp(&ent[p = (i - 1) / 2], &e) > 0; i = p)
+	ent[i] = ent[p];
+    ent[i] = e;
+}
+
+static unsigned topSerial;
+static __thread unsigned heapSerial;
+static __thread struct topHeap *heapSlot;
+
+static struct topHeap *topHeap(struct top *t)
+{
+    if (heapSerial == t->serial)
+	return heapSlot;
+    int i = __atomic_fetch_add(&t->nheaps, 1, __ATOMIC_RELAXED);
+    assert(i < MAXTHREADS + 1);
+    heapSerial = t->serial;
+    return heapSlot = &t->heap[i];
+}
+
+// The job for pkglistQueryTop, in place of formatBlob.  The result
+// is always empty, the winners are formatted by topFinish.
+static char *topJob(void *blob, unsigned blobSize, void *arg,
+		    size_t *lenp, const char *err[2])
+{
+    struct pkglistQuery *q = arg;
+    struct top *t = q->top;
+    struct topEnt e = { 0, NULL, 0, NULL, 0 };
+    blobSize -= sizeof e.ord;
+    memcpy(&e.ord, (char *) blob + blobSize, sizeof e.ord);
+    if (!hdrblobCheck(blob, blobSize)) {
+	free(blob);
+	err[0] = "hdrblobCheck", err[1] = "malformed header";
+	return NULL;
+    }
+    // The string points into the blob, until it is copied.
+    bool have = true;
+    if (t->count)
+	e.num = hdrblobCount(blob, t->tag);
+    else if (!hdrblobInt(blob, t->tag, &e.num))
+	have = (e.str = (char *) hdrblobString(blob, t->tag)) != NULL;
+    struct topHeap *heap = topHeap(t);
+    if (have && heap->n == t->k && topCmp(&e, &heap->ent[0]) <= 0)
+	have = false;
+    if (!have) {
+	free(blob);
+	return emptyResult(lenp, err);
+    }
+    if (heap->n == heap->alloc && heap->n < t->k) {
+	unsigned alloc = heap->alloc ? 2 * heap->alloc : 64;
+	if (alloc > t->k)
+	    alloc = t->k;
+	struct topEnt *ent = realloc(heap->ent, alloc * sizeof *ent);
+	if (!ent) {
+	    free(blob);
+	    err[0] = "realloc", err[1] = xstrerror(ENOMEM);
+	    return NULL;
+	}
+	heap->ent = ent, heap->alloc = alloc;
+    }
+    if (e.str && !(e.str = strdup(e.str))) {
+	free(blob);
+	err[0] = "strdup", err[1] = xstrerror(ENOMEM);
+	return NULL;
+    }
+    struct threadStats *ts = q->stats ? threadStats(q) : NULL;
+    if (ts)
+	e.mem = headerMem(blob, blobSize);
+    e.h = headerImport(blob, blobSize, HEADERIMPORT_FAST);
+    if (!e.h) {
+	free(e.str);
+	err[0] = "headerImport", err[1] = "import failed";
+	return NULL;
+    }
+    if (ts) memAlloc(q, ts, MEM_HEADER, e.mem);
+    if (q->nwhere) {
+	err[0] = NULL;
+	if (!where(q, e.h, err)) {
+	    headerFree(e.h);
+	    if (ts) memFree(q, ts, MEM_HEADER, e.mem);
+	    free(e.str);
+	    return err[0] ? NULL : emptyResult(lenp, err);
+	}
+    }
+    if (heap->n < t->k) {
+	heap->ent[heap->n] = e;
+	topSiftUp(heap->ent, heap->n++);
+    }
+    else {
+	headerFree(heap->ent[0].h);
+	if (ts) memFree(q, ts, MEM_HEADER, heap->ent[0].mem);
+	free(heap->ent[0].str);
+	heap->ent[0] = e;
+	topSiftDown(heap->ent, heap->n, 0);
+    }
+    return emptyResult(lenp, err);
+}
+
+static int topCmpBest(const void *a, const void *b)
+{
+    return topCmp(b, a);
+}
+
+// Merge the heaps and pass the winners to the callback, best first.
+static int topFinish(struct pkglistQuery *q, const char *err[2])
+{
+    struct top *t = q->top;
+    size_t n = 0;
+    for (int i = 0; i < t->nheaps; i++)
+	n += t->heap[i].n;
+    struct topEnt *all = malloc(n * sizeof *all + 1);
+    if (!all) {
+	err[0] = "malloc", err[1] = xstrerror(ENOMEM);
+	return -1;
+    }
+    n = 0;
+    for (int i = 0; i < t->nheaps; i++) {
+	struct topHeap *heap = &t->heap[i];
+	memcpy(all + n, heap->ent, heap->n * sizeof *all);
+	n += heap->n, heap->n = 0;
+    }
+    qsort(all, n, sizeof *all, topCmpBest);
+    int rc = 0;
+    for (size_t i = 0; i < n; i++) {
+	if (rc == 0 && i < t->k) {
+	    const char *fmterr = "format failed";
+	    char *str = headerFormat(all[i].h, q->fmt, &fmterr);
+	    if (!str)
+		err[0] = "headerFormat", err[1] = fmterr, rc = -1;
+	    else if (q->cb(q->cbArg, str, strlen(str)))
+		err[0] = "sink", err[1] = "stopped", rc = -1;
+	    free(str);
+	}
+	headerFree(all[i].h);
+	if (q->stats) memFree(q, NULL, MEM_HEADER, all[i].mem);
+	free(all[i].str);
+    }
+    free(all);
+    return rc;
+}
+
+static void topFree(struct top *t)
+{
+    if (!t)
+	return;
+    for (int i = 0; i < t->nheaps; i++) {
+	struct topHeap *heap = &t->heap[i];
+	for (unsigned j = 0; j < heap->n; j++) {
+	    headerFree(heap->ent[j].h);
+	    free(heap->ent[j].str);
+	}
+	free(heap->ent);
+    }
+    free(t);
+}
+
+// With pkglistQueryDedup, the blob is followed by its tag: the id, and
+// the duplicate bit, in which case the blob is empty.  The job's result is
+// also followed by the tag, after the terminating NUL.
+static char *dedupJob(void *blob, unsigned blobSize, void *arg,
+		      size_t *lenp, const char *err[2])
+{
+    struct pkglistQuery *q = arg;
+    uint64_t tag;
+    blobSize -= sizeof tag;
+    memcpy(&tag, (char *) blob + blobSize, sizeof tag);
+    char *str = NULL;
+    size_t len = 0;
+    if (tag & 1)
+	free(blob);
+    else if (!(str = q->job(blob, blobSize, q->jobArg, &len, err)))
+	return NULL;
+    char *s = realloc(str, len + 1 + sizeof tag);
+    if (!s) {
+	free(str);
+	err[0] = "realloc", err[1] = xstrerror(ENOMEM);
+	return NULL;
+    }
+    s[len] = '\0';
+    memcpy(s + len + 1, &tag, sizeof tag);
+    *lenp = len + 1 + sizeof tag;
+    return s;
+}
+
+// Untag the result, keep it or replace it with the cached one, and pass
+// it on to the callback.  The results come in order, so the first blob's
+// output is always cached by the time its duplicates get here.
+static int dedupSink(void *arg, const char *str, size_t len)
+{
+    struct pkglistQuery *q = arg;
+    uint64_t tag;
+    len -= 1 + sizeof tag;
+    memcpy(&tag, str + len + 1, sizeof tag);
+    if (tag & 1)
+	str = dedupFetch(q->dedup, tag >> 1, &len);
+    else if (!dedupStore(q->dedup, tag >> 1, str, len))
+	return -1;
+    return q->cb(q->cbArg, str, len);
+}
+
+// With the stats, the blob is handed over to the job, and the result
+// is held until the sink takes it.
+static char *statsJob(void *blob, unsigned blobSize, void *arg,
+		      size_t *lenp, const char *err[2])
+{
+    struct pkglistQuery *q = arg;
+    memFree(q, NULL, MEM_BLOB, blobSize);
+    char *str = q->dedup ? dedupJob(blob, blobSize, q, lenp, err) :
+			   q->job(blob, blobSize, q->jobArg, lenp, err);
+    if (str)
+	memAlloc(q, threadStats(q), MEM_RESULT, *lenp);
+    return str;
+}
+
+// Count the result and pass it on; the sink runs on one thread
+// at a time, under the queue's lock or on the feeder with the processes.
+static int countSink(void *arg, const char *str, size_t len)
+{
+    struct pkglistQuery *q = arg;
+    __atomic_store_n(&q->ndone, q->ndone + 1, __ATOMIC_RELAXED);
+    return q->dedup ? dedupSink(q, str, len) : q->cb(q->cbArg, str, len);
+}
+
+// With pkglistQueryOutputFd, the sink only gives each result its offset,
+// the running sum of the sizes, which is computed in order.  The writes are
+// left to the thread which ran the sink, to be made with pwrite(2) after it
+// releases the queue's lock, in parallel with the others.  Under the lock,
+// the sink usually runs for at most NQ results at a time; if there are more,
+// the array is moved to the heap, for no write to be made under the lock.
+struct pendingWrite {
+    char *str;
+    size_t len;
+    uint64_t off;
+};
+
+static __thread struct pendingWrite pendingBuf[NQ];
+static __thread struct pendingWrite *pendingHeap;
+static __thread unsigned npending, pendingAlloc;
+
+// Keep the first write error.
+static void setWriteErrno(struct pkglistQuery *q, int errnum)
+{
+    int zero = 0;
+    __atomic_compare_exchange_n(&q->writeErrno, &zero, errnum, false,
+	    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+static void drainWrites(void *arg)
+{
+    struct pkglistQuery *q = arg;
+    struct pendingWrite *pending = pendingHeap ? pendingHeap : pendingBuf;
+    for (unsigned i = 0; i < npending; i++) {
+	const char *p = pending[i].str;
+	size_t n = pending[i].len;
+	uint64_t off = pending[i].off;
+	while (n && !__atomic_load_n(&q->writeErrno, __ATOMIC_RELAXED)) {
+	    ssize_t k = pwrite(q->outFd, p, n, off);
+	    if (k < 0 && errno == EINTR)
+		continue;
+	    if (k < 0)
+		setWriteErrno(q, errno);
+	    // Nothing written, as with a full device.
+	    else if (k == 0)
+		setWriteErrno(q, ENOSPC);
+	    if (k <= 0)
+		break;
+	    p += k, n -= k, off += k;
+	}
+	free(pending[i].str);
+    }
+    npending = 0;
+    free(pendingHeap);
+    pendingHeap = NULL;
+}
+
+// Take the string, giving it the next offset.  A write error stops the query.
+static int takeWrite(struct pkglistQuery *q, char *str, size_t len)
+{
+    if (__atomic_load_n(&q->writeErrno, __ATOMIC_RELAXED)) {
+	free(str);
+	return -1;
+    }
+    if (len == 0) {
+	free(str);
+	return 0;
+    }
+    // With the processes, there is no queue, and no lock: the writes
+    // are made as the results pile up.
+    if (npending == NQ && q->procs)
+	drainWrites(q);
+    if (npending >= NQ && npending == (pendingHeap ? pendingAlloc : NQ)) {
+	unsigned alloc = 2 * npending;
+	struct pendingWrite *heap = realloc(pendingHeap, alloc * sizeof *heap);
+	if (!heap) {
+	    setWriteErrno(q, ENOMEM);
+	    free(str);
+	    return -1;
+	}
+	if (!pendingHeap)
+	    memcpy(heap, pendingBuf, npending * sizeof *heap);
+	pendingHeap = heap, pendingAlloc = alloc;
+    }
+    struct pendingWrite *pending = pendingHeap ? pendingHeap : pendingBuf;
+    pending[npending++] = (struct pendingWrite) { str, len, q->outOff };
+    q->outOff += len;
+    return 0;
+}
+
+// A write error is what stopped the query.
+static bool writeFailed(struct pkglistQuery *q, const char *err[2])
+{
+    int errnum = __atomic_load_n(&q->writeErrno, __ATOMIC_RELAXED);
+    if (errnum)
+	err[0] = "pwrite", err[1] = xstrerror(errnum);
+    return errnum;
+}
+
+// The callback with pkglistQueryOutputFd, for the results which are not
+// the sink's to take: those from the dedup cache, the processes, and
+// pkglistQueryTop.
+static int outputCallback(void *arg, const char *str, size_t len)
+{
+    struct pkglistQuery *q = arg;
+    char *copy = malloc(len + 1);
+    if (!copy) {
+	setWriteErrno(q, ENOMEM);
+	return -1;
+    }
+    memcpy(copy, str, len);
+    return takeWrite(q, copy, len);
+}
+
+// The sink: pass the string to the callback.
+static int callback(void *arg, char *str, size_t len)
+{
+    struct pkglistQuery *q = arg;
+    if (q->stats)
+	memFree(q, NULL, MEM_RESULT, len);
+    if (q->output && !q->dedup) {
+	__atomic_store_n(&q->ndone, q->ndone + 1, __ATOMIC_RELAXED);
+	return takeWrite(q, str, len);
+    }
+    int rc = countSink(q, str, len);
+    free(str);
+    return rc;
+}
+
+struct pkglistQuery *pkglistQueryNewJob(pkglistQueryJob job, void *jobArg,
+	int nthreads, pkglistQueryCallback cb, void *arg, const char *err[2])
+{
+    if (nthreads < 1 || nthreads > MAXTHREADS) {
+	err[0] = "pkglistQueryNew", err[1] = "bad number of threads";
+	return NULL;
+    }
+    struct pkglistQuery *q = malloc(sizeof *q);
+    if (!q) {
+	err[0] = "malloc", err[1] = xstrerror(ENOMEM);
+	return NULL;
+    }
+    memset(q, 0, sizeof *q);
+    q->job = job, q->jobArg = jobArg;
+    q->cb = cb, q->cbArg = arg;
+    // The number of threads is kept here until the start.
+    q->Q.nthreads = nthreads;
+    return q;
+}
+
+struct pkglistQuery *pkglistQueryNew(const char *fmt, int nthreads,
+	pkglistQueryCallback cb, void *arg, const char *err[2])
+{
+    // Check the format on an empty header, unknown tags and such
+    // are reported at this stage.  This also makes librpm load its tag
+    // table and such before the threads are started, rather than
+    // having them race for it.  Likewise, the time zone is loaded
+    // for :date formatting.
+    tzset();
+    Header h = headerNew();
+    const char *fmterr = "format failed";
+    char *str = headerFormat(h, fmt, &fmterr);
+    headerFree(h);
+    if (!str) {
+	err[0] = "headerFormat", err[1] = fmterr;
+	return NULL;
+    }
+    free(str);
+    size_t fmtSize = strlen(fmt) + 1;
+    struct pkglistQuery *q = pkglistQueryNewJob(formatBlob, NULL,
+	    nthreads, cb, arg, err);
+    if (!q)
+	return NULL;
+    struct pkglistQuery *qq = realloc(q, sizeof *q + fmtSize);
+    if (!qq) {
+	free(q);
+	err[0] = "realloc", err[1] = xstrerror(ENOMEM);
+	return NULL;
+    }
+    q = qq;
+    memcpy(q->fmt, fmt, fmtSize);
+    q->jobArg = q;
+    return q;
+}
+
+// The header digests, as computed by rpm over the immutable region:
+// the header magic, the region's il and dl, its index entries, and
+// its data.  The digest's speed is that of rpm's crypto backend, which
+// usually comes with SHA-NI and SIMD implementations.
+static const struct {
+    rpmTag tag;
+    int algo;
+    const char *mismatch;
+} digests[] = {
+    { RPMTAG_SHA256HEADER, PGPHASHALGO_SHA256, "SHA256HEADER mismatch" },
+    { RPMTAG_SHA1HEADER, PGPHASHALGO_SHA1, "SHA1HEADER mismatch" },
+};
+
+// Returns the problem with the header, or NULL if the digests match.
+static const char *checkDigests(const void *blob)
+{
+    unsigned ril, rdl;
+    if (!hdrblobRegion(blob, &ril, &rdl))
+	return "no region";
+    int nchecked = 0;
+    for (size_t i = 0; i < sizeof digests / sizeof *digests; i++) {
+	const char *want = hdrblobString(blob, digests[i].tag);
+	if (!want)
+	    continue;
+	DIGEST_CTX ctx = rpmDigestInit(digests[i].algo, RPMDIGEST_NONE);
+	uint32_t ildl[2] = { htonl(ril), htonl(rdl) };
+	rpmDigestUpdate(ctx, magic, sizeof magic);
+	rpmDigestUpdate(ctx, ildl, sizeof ildl);
+	rpmDigestUpdate(ctx, (const char *) blob + 8, 16 * ril);
+	rpmDigestUpdate(ctx, hdrblobData(blob), rdl);
+	char *got = NULL;
+	rpmDigestFinal(ctx, (void **) &got, NULL, 1);
+	bool ok = got && strcmp(got, want) == 0;
+	free(got);
+	if (!ok)
+	    return digests[i].mismatch;
+	nchecked++;
+    }
+    return nchecked ? NULL : "no digest";
+}
+
+// The job for pkglistQueryNewVerify, which works right on the blob.
+static char *verifyBlob(void *blob, unsigned blobSize, void *arg,
+			size_t *lenp, const char *err[2])
+{
+    (void) arg;
+    const char *what = "malformed header";
+    const char *nevra[4] = { "?", "?", "?", "?" };
+    char e[16] = "";
+    if (hdrblobCheck(blob, blobSize)) {
+	static const rpmTag tags[4] = {
+	    RPMTAG_NAME, RPMTAG_VERSION, RPMTAG_RELEASE, RPMTAG_ARCH,
+	};
+	for (int i = 0; i < 4; i++)
+	    nevra[i] = hdrblobString(blob, tags[i]) ?: nevra[i];
+	uint32_t epoch;
+	if (hdrblobInt32(blob, RPMTAG_EPOCH, &epoch))
+	    snprintf(e, sizeof e, "%u:", (unsigned) epoch);
+	what = checkDigests(blob);
+    }
+    char *str = NULL;
+    int len = 0;
+    if (what) {
+	const char *fmt = "%s-%s%s-%s.%s\t%s\n";
+	len = snprintf(NULL, 0, fmt, nevra[0], e, nevra[1], nevra[2], nevra[3], what);
+	if ((str = malloc(len + 1)))
+	    snprintf(str, len + 1, fmt, nevra[0], e, nevra[1], nevra[2], nevra[3], what);
+    }
+    else if ((str = malloc(1)))
+	*str = '\0';
+    free(blob);
+    if (!str) {
+	err[0] = "malloc", err[1] = xstrerror(ENOMEM);
+	return NULL;
+    }
+    *lenp = len;
+    return str;
+}
+
+struct pkglistQuery *pkglistQueryNewVerify(int nthreads,
+	pkglistQueryCallback cb, void *arg, const char *err[2])
+{
+    return pkglistQueryNewJob(verifyBlob, NULL, nthreads, cb, arg, err);
+}
+
+struct pkglistQuery *pkglistQueryNewRaw(int nthreads,
+	pkglistQueryCallback cb, void *arg, const char *err[2])
+{
+    struct pkglistQuery *q = pkglistQueryNewJob(formatBlob, NULL,
+	    nthreads, cb, arg, err);
+    if (!q)
+	return NULL;
+    q->jobArg = q;
+    q->raw = true;
+    return q;
+}
+
+int pkglistQueryWhere(struct pkglistQuery *q, const char *cond, const char *err[2])
+{
+    assert(!q->started);
+    if (q->job != formatBlob) {
+	err[0] = "pkglistQueryWhere", err[1] = "not supported for this query";
+	return -1;
+    }
+    const char *eq = strchr(cond, '=');
+    if (!eq || eq == cond) {
+	err[0] = "pkglistQueryWhere", err[1] = "expecting TAG=GLOB";
+	return -1;
+    }
+    size_t tagLen = eq - cond;
+    struct where w = { malloc(tagLen + sizeof "[%{}\n]"), strdup(eq + 1) };
+    struct where *ww = realloc(q->where, (q->nwhere + 1) * sizeof *ww);
+    if (!w.fmt || !w.glob || !ww) {
+	free(w.fmt), free(w.glob);
+	if (ww)
+	    q->where = ww;
+	err[0] = "malloc", err[1] = xstrerror(ENOMEM);
+	return -1;
+    }
+    q->where = ww;
+    sprintf(w.fmt, "[%%{%.*s}\n]", (int) tagLen, cond);
+    // Unknown tags are reported right away.
+    Header h = headerNew();
+    const char *fmterr = "format failed";
+    char *str = headerFormat(h, w.fmt, &fmterr);
+    headerFree(h);
+    if (!str) {
+	free(w.fmt), free(w.glob);
+	err[0] = "headerFormat", err[1] = fmterr;
+	return -1;
+    }
+    free(str);
+    q->where[q->nwhere++] = w;
+    return 0;
+}
+
+int pkglistQueryStrip(struct pkglistQuery *q, const char *tag, const char *err[2])
+{
+    assert(!q->started);
+    if (!q->raw) {
+	err[0] = "pkglistQueryStrip", err[1] = "only for raw queries";
+	return -1;
+    }
+    int val = rpmTagGetValue(tag);
+    if (val < 0) {
+	err[0] = "rpmTagGetValue", err[1] = "unknown tag";
+	return -1;
+    }
+    int *strip = realloc(q->strip, (q->nstrip + 1) * sizeof *strip);
+    if (!strip) {
+	err[0] = "realloc", err[1] = xstrerror(ENOMEM);
+	return -1;
+    }
+    q->strip = strip;
+    q->strip[q->nstrip++] = val;
+    return 0;
+}
+
+int pkglistQueryTop(struct pkglistQuery *q, unsigned k, const char *by, const char *err[2])
+{
+    assert(!q->started && !q->dedup && !q->top);
+    if (q->job != formatBlob || q->raw) {
+	err[0] = "pkglistQueryTop", err[1] = "only for format queries";
+	return -1;
+    }
+    if (k < 1) {
+	err[0] = "pkglistQueryTop", err[1] = "bad number of headers";
+	return -1;
+    }
+    bool count = *by == '#';
+    if (count)
+	by++;
+    // The file names are only counted, and they are not in the header
+    // as such, librpm makes them up from BASENAMES and DIRNAMES.
+    int tag = count && strcmp(by, "FILENAMES") == 0 ? RPMTAG_BASENAMES : rpmTagGetValue(by);
+    if (tag < 0) {
+	err[0] = "rpmTagGetValue", err[1] = "unknown tag";
+	return -1;
+    }
+    q->top = calloc(1, sizeof *q->top);
+    if (!q->top) {
+	err[0] = "calloc", err[1] = xstrerror(ENOMEM);
+	return -1;
+    }
+    q->top->k = k, q->top->tag = tag, q->top->count = count;
+    q->top->serial = __atomic_add_fetch(&topSerial, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+int pkglistQueryDedup(struct pkglistQuery *q, size_t budget, const char *err[2])
+{
+    assert(!q->started && !q->trace && !q->top);
+    q->dedup = dedupNew(budget);
+    if (!q->dedup) {
+	err[0] = "dedupNew", err[1] = xstrerror(ENOMEM);
+	return -1;
+    }
+    return 0;
+}
+
+void pkglistQueryEnableStats(struct pkglistQuery *q)
+{
+    assert(!q->started);
+    q->stats = true;
+    q->statsSerial = __atomic_add_fetch(&statsSerial, 1, __ATOMIC_RELAXED);
+}
+
+void pkglistQueryPrintStats(struct pkglistQuery *q, FILE *fp)
+{
+    if (q->dedup)
+	dedupPrintStats(q->dedup, fp);
+    if (!q->stats)
+	return;
+    struct threadStats total = { 0 };
+    for (int i = 0; i <= q->nslots; i++) {
+	struct threadStats *ts = i < q->nslots ? &q->slot[i] : &total;
+	for (int j = 0; j < NCALLS; j++) {
+	    struct callStats *c = &ts->call[j];
+	    if (i < q->nslots) {
+		total.call[j].calls += c->calls;
+		total.call[j].wallNs += c->wallNs;
+		total.call[j].cpuNs += c->cpuNs;
+	    }
+	    if (c->calls == 0)
+		continue;
+	    uint64_t wait = c->wallNs > c->cpuNs ? c->wallNs - c->cpuNs : 0;
+	    char who[16];
+	    if (i < q->nslots)
+		snprintf(who, sizeof who, "thread %d", i);
+	    else
+		strcpy(who, "total");
+	    fprintf(fp, "%s: %-12s %8llu calls, wall %9.3f ms, cpu %9.3f ms, "
+		    "off-cpu %9.3f ms (%.0f ns/call)\n", who, callNames[j],
+		    (unsigned long long) c->calls, c->wallNs / 1e6, c->cpuNs / 1e6,
+		    wait / 1e6, (double) wait / c->calls);
+	}
+    }
+    for (int i = 0; i < NMEMS; i++) {
+	uint64_t allocs = 0;
+	for (int j = 0; j < q->nslots; j++)
+	    allocs += q->slot[j].mem[i].allocs;
+	fprintf(fp, "memory: %-8s %8llu allocs, peak %9.3f MB, left %9.3f MB%s\n",
+		memNames[i], (unsigned long long) allocs, q->memPeak[i] / 1e6,
+		q->memCur[i] / 1e6, i == MEM_HEADER ? " (estimated)" : "");
+    }
+    for (int i = 0; i < q->nslots; i++) {
+	struct threadStats *ts = &q->slot[i];
+	fprintf(fp, "thread %d: memory:", i);
+	for (int j = 0; j < NMEMS; j++)
+	    fprintf(fp, " %llu %s %.3f MB%s", (unsigned long long) ts->mem[j].allocs,
+		    memNames[j], ts->mem[j].bytes / 1e6, j < NMEMS - 1 ? "," : "");
+	fprintf(fp, ", headers peak %.3f MB\n", ts->headerPeak / 1e6);
+    }
+    // The rest is the allocator's own: the free chunks it keeps in the
+    // arenas, and the overhead.
+    struct mallinfo2 mi = mallinfo2();
+    fprintf(fp, "allocator: %.3f MB from the system (%.3f MB mmapped), "
+	    "%.3f MB in use, %.3f MB free in the arenas\n",
+	    (mi.arena + mi.hblkhd) / 1e6, mi.hblkhd / 1e6,
+	    (mi.uordblks + mi.hblkhd) / 1e6, mi.fordblks / 1e6);
+}
+
+// Print the string on one line, with the C escapes.
+static void printEscaped(const char *s, FILE *fp)
+{
+    for (; *s; s++) {
+	switch (*s) {
+	case '\n': fputs("\\n", fp); break;
+	case '\t': fputs("\\t", fp); break;
+	case '\\': fputs("\\\\", fp); break;
+	default: putc(*s, fp);
+	}
+    }
+}
+
+// Print the tags referenced by a headerFormat format, each one once:
+// "%{TAG}", "%-10{TAG:fmt}", "%{?TAG:...}", "%{#TAG}", "%|TAG?{...}|", etc.
+static void printTags(const char *fmt, FILE *fp)
+{
+    static const char tagChars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+	    "abcdefghijklmnopqrstuvwxyz0123456789_";
+    struct { const char *s; size_t len; } seen[64];
+    size_t nseen = 0;
+    for (const char *p = fmt; (p = strchr(p, '%')); ) {
+	p++;
+	if (*p == '%') {
+	    p++;
+	    continue;
+	}
+	p += strspn(p, "-0123456789. ");
+	if (*p != '{' && *p != '|')
+	    continue;
+	p++;
+	p += strspn(p, "?!=#");
+	size_t len = strspn(p, tagChars);
+	if (len == 0)
+	    continue;
+	bool dup = false;
+	for (size_t i = 0; !dup && i < nseen; i++)
+	    dup = seen[i].len == len && strncasecmp(seen[i].s, p, len) == 0;
+	if (!dup) {
+	    fprintf(fp, " %.*s", (int) len, p);
+	    if (nseen < sizeof seen / sizeof *seen)
+		seen[nseen].s = p, seen[nseen++].len = len;
+	}
+	p += len;
+    }
+}
+
+void pkglistQueryExplain(struct pkglistQuery *q, FILE *fp)
+{
+    assert(!q->started);
+    bool format = q->job == formatBlob && !q->raw;
+    fprintf(fp, "query: %s, on %d %s, the feeder taking part\n",
+	    format ? "format" : q->raw ? "raw headers" :
+	    q->job == verifyBlob ? "verify" : "custom job",
+	    q->Q.nthreads, q->procs ? q->Q.nthreads > 1 ? "worker processes" : "worker process" :
+	    q->Q.nthreads > 1 ? "threads" : "thread");
+    if (format) {
+	fputs("format: ", fp);
+	printEscaped(q->fmt, fp);
+	fputs("\ntags:", fp);
+	printTags(q->fmt, fp);
+	putc('\n', fp);
+    }
+    for (int i = 0; i < q->nwhere; i++) {
+	// The condition's format is "[%{TAG}\n]".
+	const char *tag = q->where[i].fmt + 3;
+	fprintf(fp, "where: %.*s=%s\n", (int) (strlen(tag) - 3), tag, q->where[i].glob);
+    }
+    if (q->nstrip) {
+	fputs("strip:", fp);
+	for (int i = 0; i < q->nstrip; i++)
+	    fprintf(fp, " %s", rpmTagGetName(q->strip[i]) ?: "?");
+	putc('\n', fp);
+    }
+    // What is done on the workers with each header.
+    fputs("per header:", fp);
+    if (q->job == verifyBlob)
+	fputs(" hdrblob parse, SHA256HEADER and SHA1HEADER over the region, no librpm", fp);
+    else if (q->raw || format) {
+	if (q->top)
+	    fprintf(fp, " hdrblob parse, %s%s read from the blob; for the candidates only:",
+		    q->top->count ? "#" : "", rpmTagGetName(q->top->tag) ?: "?");
+	if (q->raw && !q->nwhere)
+	    fputs(" no librpm,", fp);
+	else {
+	    fputs(" headerImport,", fp);
+	    int nformat = q->nwhere + (format && !q->top);
+	    if (nformat)
+		fprintf(fp, " %d headerFormat (%d for where),", nformat, q->nwhere);
+	    fputs(" headerFree,", fp);
+	}
+	if (q->raw)
+	    fputs(q->nstrip ? " hdrblobStrip into a copy" : " blob copy", fp);
+	else if (q->top)
+	    fputs(" heap push", fp);
+	else
+	    fputs(" string to the callback", fp);
+    }
+    else
+	fputs(" the job", fp);
+    putc('\n', fp);
+    if (q->top)
+	fprintf(fp, "top: %u headers by %s%s, a bounded heap per thread, "
+		"%u headerFormat at the finish\n", q->top->k, q->top->count ? "#" : "",
+		rpmTagGetName(q->top->tag) ?: "?", q->top->k);
+    if (q->dedup)
+	fprintf(fp, "dedup: a 128-bit hash of each blob on the feeder, the duplicates "
+		"skip the workers, output cache up to %zu MB\n", dedupBudget(q->dedup) >> 20);
+    if (q->stats)
+	fputs("stats: the librpm calls are timed\n", fp);
+    if (q->trace)
+	fputs("trace: each header is timed\n", fp);
+    if (q->procs && q->huge)
+	fputs("huge pages: for the rings shared with the worker processes\n", fp);
+}
+
+void pkglistQueryTrace(struct pkglistQuery *q, FILE *fp)
+{
+    assert(!q->started);
+    q->trace = fp;
+}
+
+void pkglistQueryUseProcesses(struct pkglistQuery *q)
+{
+    assert(!q->started);
+    q->procs = true;
+}
+
+int pkglistQueryOutputFd(struct pkglistQuery *q, int fd, const char *err[2])
+{
+    assert(!q->started && !q->output);
+    off_t off = lseek(fd, 0, SEEK_CUR);
+    if (off < 0) {
+	err[0] = "lseek", err[1] = xstrerror(errno);
+	return -1;
+    }
+    q->output = true;
+    q->outFd = fd, q->outOff = off;
+    q->cb = outputCallback, q->cbArg = q;
+    return 0;
+}
+
+void pkglistQueryUseHugePages(struct pkglistQuery *q)
+{
+    assert(!q->started);
+    q->huge = true;
+}
+
+static inline uint64_t now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// With the trace, the job knows the header's ordinal and decoding time.
+struct traced {
+    void *blob;
+    unsigned ord;
+    uint64_t decodeNs;
+};
+
+static char *traceJob(void *blob, unsigned blobSize, void *arg,
+		      size_t *lenp, const char *err[2])
+{
+    struct pkglistQuery *q = arg;
+    struct traced t = *(struct traced *) blob;
+    free(blob);
+    uint64_t t0 = now();
+    char *str = q->stats ? statsJob(t.blob, blobSize, q, lenp, err) :
+			   q->job(t.blob, blobSize, q->jobArg, lenp, err);
+    uint64_t jobNs = now() - t0;
+    // A single call, so that the lines from different threads
+    // do not interleave.
+    fprintf(q->trace, "%u\t%u\t%llu\t%llu\n", t.ord, blobSize,
+	    (unsigned long long) t.decodeNs, (unsigned long long) jobNs);
+    return str;
+}
+
+static bool startQuery(struct pkglistQuery *q, const char *err[2])
+{
+    q->started = true;
+    __atomic_store_n(&q->startNs, now(), __ATOMIC_RELAXED);
+    if (q->top) {
+	// The heaps would be left in the workers' memory.
+	assert(!q->procs);
+	q->job = topJob;
+    }
+    pkglistQueryJob job = q->dedup ? dedupJob : q->job;
+    void *jobArg = q->dedup ? q : q->jobArg;
+    drainFunc drain = q->output ? drainWrites : NULL;
+    if (q->procs) {
+	// The stats and the trace would be left in the workers' memory.
+	assert(!q->stats && !q->trace);
+	q->mp = mprocStart(q->Q.nthreads, q->huge, job, jobArg, countSink, q, err);
+	return q->mp != NULL;
+    }
+    if (q->trace)
+	start(&q->Q, q->Q.nthreads, traceJob, q, callback, drain, q);
+    else if (q->stats)
+	start(&q->Q, q->Q.nthreads, statsJob, q, callback, drain, q);
+    else
+	start(&q->Q, q->Q.nthreads, job, jobArg, callback, drain, q);
+    return true;
+}
+
+// The error message may need to be composed from the outer function
+// name and the inner error.
+static __thread char errbuf[256];
+
+// Append the tag to the blob, for the job to pick up.  On failure,
+// the blob is freed.
+static void *tagBlob(void *blob, size_t *sizep, uint64_t tag,
+	const char *err[2])
+{
+    void *tagged = realloc(blob, *sizep + sizeof tag);
+    if (!tagged) {
+	free(blob);
+	err[0] = "realloc", err[1] = xstrerror(ENOMEM);
+	return NULL;
+    }
+    memcpy((char *) tagged + *sizep, &tag, sizeof tag);
+    *sizep += sizeof tag;
+    return tagged;
+}
+
+// Feed one blob, which the query then owns.
+static bool feedBlob(struct pkglistQuery *q, void *blob, size_t size,
+	uint64_t decodeNs, const char *err[2])
+{
+    size_t blobSize = size;
+    if (q->top) {
+	blob = tagBlob(blob, &size, q->top->ord++, err);
+	if (!blob) {
+	    writeFailed(q, err);
+	    return false;
+	}
+    }
+    if (q->dedup) {
+	bool dup;
+	uint64_t tag = dedupLookup(q->dedup, blob, size, &dup) << 1 | dup;
+	if (dup)
+	    free(blob), blob = NULL, size = 0;
+	blob = tagBlob(blob, &size, tag, err);
+	if (!blob) {
+	    writeFailed(q, err);
+	    return false;
+	}
+    }
+    if (q->stats)
+	memAlloc(q, threadStats(q), MEM_BLOB, size);
+    if (q->mp) {
+	if (!mprocBlob(q->mp, blob, size, err)) {
+	    writeFailed(q, err);
+	    return false;
+	}
+    }
+    else {
+	void *wrapped = blob;
+	if (q->trace) {
+	    struct traced *t = malloc(sizeof *t);
+	    if (!t) {
+		free(blob);
+		if (q->stats)
+		    memFree(q, NULL, MEM_BLOB, size);
+		err[0] = "malloc", err[1] = xstrerror(ENOMEM);
+		writeFailed(q, err);
+		return false;
+	    }
+	    *t = (struct traced) { blob, q->traceOrd++, decodeNs };
+	    wrapped = t;
+	}
+	if (!processBlob(&q->Q, wrapped, size)) {
+	    if (wrapped != blob)
+		free(wrapped);
+	    free(blob);
+	    if (q->stats)
+		memFree(q, NULL, MEM_BLOB, size);
+	    err[0] = q->Q.err[0], err[1] = q->Q.err[1];
+	    writeFailed(q, err);
+	    return false;
+	}
+    }
+    __atomic_store_n(&q->nfed, q->nfed + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&q->fedBytes, q->fedBytes + blobSize, __ATOMIC_RELAXED);
+    return true;
+}
+
+// Feed the headers, only those marked in the keep bitmap, if any.
+static ssize_t queryFd(struct pkglistQuery *q, int fd,
+	const unsigned char *keep, size_t nkeep, const char *err[2])
+{
+    assert(!q->finished);
+    if (!q->started && !startQuery(q, err)) {
+	close(fd);
+	return -1;
+    }
+    ssize_t n = 0;
+    struct zpkglistReader *z;
+    const char *func = "zpkglistFdopen";
+    ssize_t ret = zpkglistFdopen(&z, fd, err);
+    if (ret > 0) {
+	void *blob;
+	func = "zpkglistNextMalloc";
+	uint64_t t0 = q->trace ? now() : 0;
+	size_t i = 0;
+	while ((ret = zpkglistNextMalloc(z, &blob, NULL, false, err)) > 0) {
+	    if (keep) {
+		if (i >= nkeep) {
+		    free(blob);
+		    err[0] = "pkglistQueryFdMerged", err[1] = "the pkglist has changed";
+		    ret = -1, func = NULL;
+		    break;
+		}
+		bool skip = !(keep[i / 8] & (1 << (i % 8)));
+		i++;
+		if (skip) {
+		    free(blob);
+		    continue;
+		}
+	    }
+	    if (!feedBlob(q, blob, ret, q->trace ? now() - t0 : 0, err)) {
+		ret = -1, func = NULL;
+		break;
+	    }
+	    n++;
+	    if (q->trace)
+		t0 = now();
+	}
+	zpkglistFree(z);
+    }
+    close(fd);
+    if (ret < 0) {
+	if (func && strcmp(func, err[0]) && strncmp(err[0], "zpkglist", 8)) {
+	    snprintf(errbuf, sizeof errbuf, "%s: %s", func, err[0]);
+	    err[0] = errbuf;
+	}
+	return -1;
+    }
+    return n;
+}
+
+ssize_t pkglistQueryFd(struct pkglistQuery *q, int fd, const char *err[2])
+{
+    return queryFd(q, fd, NULL, 0, err);
+}
+
+ssize_t pkglistQueryFdMerged(struct pkglistQuery *q, int fd,
+	struct pkglistMerge *m, int src, const char *err[2])
+{
+    size_t nkeep;
+    const unsigned char *keep = pkglistMergeKeep(m, src, &nkeep);
+    // With no headers at all, the bitmap is NULL.
+    static const unsigned char none;
+    return queryFd(q, fd, keep ? keep : &none, nkeep, err);
+}
+
+ssize_t pkglistQueryRepo(struct pkglistQuery *q, struct pkglistRepo *r,
+	const size_t *idx, size_t n, const char *err[2])
+{
+    assert(!q->finished);
+    if (!q->started && !startQuery(q, err))
+	return -1;
+    if (!idx)
+	n = pkglistRepoCount(r, NULL);
+    for (size_t i = 0; i < n; i++) {
+	uint64_t t0 = q->trace ? now() : 0;
+	unsigned size;
+	const void *blob = pkglistRepoBlob(r, idx ? idx[i] : i, &size);
+	void *copy = malloc(size);
+	if (!copy) {
+	    err[0] = "malloc", err[1] = xstrerror(ENOMEM);
+	    return -1;
+	}
+	memcpy(copy, blob, size);
+	if (!feedBlob(q, copy, size, q->trace ? now() - t0 : 0, err))
+	    return -1;
+    }
+    return n;
+}
+
+static int finishQuery(struct pkglistQuery *q, const char *err[2])
+{
+    if (!q->started && !startQuery(q, err))
+	return -1;
+    q->finished = true;
+    if (q->procs) {
+	if (!q->mp) {
+	    err[0] = "pkglistQueryFinish", err[1] = "worker processes not started";
+	    return -1;
+	}
+	bool ok = mprocFinish(q->mp, err);
+	q->mp = NULL;
+	return ok ? 0 : -1;
+    }
+    if (!finish(&q->Q)) {
+	err[0] = q->Q.err[0], err[1] = q->Q.err[1];
+	return -1;
+    }
+    if (q->top)
+	return topFinish(q, err);
+    return 0;
+}
+
+int pkglistQueryFinish(struct pkglistQuery *q, const char *err[2])
+{
+    assert(!q->finished);
+    int rc = finishQuery(q, err);
+    if (!q->output)
+	return rc;
+    // The results which this very thread has taken last.
+    drainWrites(q);
+    if (writeFailed(q, err))
+	return -1;
+    // The offset is left at the end, as if the results were written.
+    if (rc == 0 && lseek(q->outFd, q->outOff, SEEK_SET) < 0) {
+	err[0] = "lseek", err[1] = xstrerror(errno);
+	return -1;
+    }
+    return rc;
+}
+
+void pkglistQueryPrintProgress(struct pkglistQuery *q, FILE *fp)
+{
+    uint64_t t0 = __atomic_load_n(&q->startNs, __ATOMIC_RELAXED);
+    if (!t0) {
+	fputs("progress: not started\n", fp);
+	return;
+    }
+    double sec = (now() - t0) / 1e9;
+    uint64_t nfed = __atomic_load_n(&q->nfed, __ATOMIC_RELAXED);
+    uint64_t fedBytes = __atomic_load_n(&q->fedBytes, __ATOMIC_RELAXED);
+    uint64_t ndone = __atomic_load_n(&q->ndone, __ATOMIC_RELAXED);
+    fprintf(fp, "progress: %.1f s, %llu headers fed (%.0f/s, %.1f MB/s), %llu done%s\n",
+	    sec, (unsigned long long) nfed, sec > 0 ? nfed / sec : 0.0,
+	    sec > 0 ? fedBytes / 1e6 / sec : 0.0, (unsigned long long) ndone,
+	    __atomic_load_n(&q->finished, __ATOMIC_RELAXED) ? ", finishing" : "");
+    // The worker processes keep their state to themselves.
+    if (q->procs)
+	return;
+    struct qsnap qs;
+    snapshot(&q->Q, &qs);
+    fprintf(fp, "queue: %d of %d entries, %d blobs waiting (%.1f MB), %d of %d threads idle\n",
+	    qs.nq, NQ, qs.nblob, qs.blobBytes / 1e6, qs.nidle, qs.nthreads);
+    int nprog = __atomic_load_n(&q->Q.nprog, __ATOMIC_RELAXED);
+    for (int i = 0; i <= nprog; i++) {
+	struct qprog *p = &q->Q.prog[i < nprog ? i : MAXTHREADS];
+	uint64_t jobs = __atomic_load_n(&p->jobs, __ATOMIC_RELAXED);
+	uint64_t bytes = __atomic_load_n(&p->bytes, __ATOMIC_RELAXED);
+	bool busy = __atomic_load_n(&p->busy, __ATOMIC_RELAXED);
+	char who[16];
+	if (i < nprog)
+	    snprintf(who, sizeof who, "thread %d", i);
+	else
+	    strcpy(who, "feeder");
+	fprintf(fp, "%s: %s, %llu headers, %.1f MB (%.0f/s)\n", who, busy ? "busy" : "idle",
+		(unsigned long long) jobs, bytes / 1e6, sec > 0 ? jobs / sec : 0.0);
+    }
+}
+
+// A metric in the Prometheus text format, with its help and type.
+static void metric(FILE *fp, const char *name, const char *type, const char *help)
+{
+    fprintf(fp, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+void pkglistQueryPrintMetrics(struct pkglistQuery *q, FILE *fp)
+{
+    uint64_t t0 = __atomic_load_n(&q->startNs, __ATOMIC_RELAXED);
+    metric(fp, "pkglist_query_seconds", "gauge", "Time since the query started.");
+    fprintf(fp, "pkglist_query_seconds %.6f\n", t0 ? (now() - t0) / 1e9 : 0.0);
+    metric(fp, "pkglist_query_headers_total", "counter", "Headers fed to the query and done.");
+    fprintf(fp, "pkglist_query_headers_total{stage=\"fed\"} %llu\n",
+	    (unsigned long long) __atomic_load_n(&q->nfed, __ATOMIC_RELAXED));
+    fprintf(fp, "pkglist_query_headers_total{stage=\"done\"} %llu\n",
+	    (unsigned long long) __atomic_load_n(&q->ndone, __ATOMIC_RELAXED));
+    metric(fp, "pkglist_query_header_bytes_total", "counter", "Header blob bytes fed to the query.");
+    fprintf(fp, "pkglist_query_header_bytes_total %llu\n",
+	    (unsigned long long) __atomic_load_n(&q->fedBytes, __ATOMIC_RELAXED));
+    if (q->procs)
+	return;
+    struct qsnap qs;
+    snapshot(&q->Q, &qs);
+    metric(fp, "pkglist_query_queue_waits_total", "counter",
+	    "Waits of the feeder for the queue to be flushed, and of the workers for a blob.");
+    fprintf(fp, "pkglist_query_queue_waits_total{side=\"feeder\"} %llu\n",
+	    (unsigned long long) qs.produceWaits);
+    fprintf(fp, "pkglist_query_queue_waits_total{side=\"worker\"} %llu\n",
+	    (unsigned long long) qs.consumeWaits);
+    metric(fp, "pkglist_query_queue_wait_seconds_total", "counter", "Time spent in those waits.");
+    fprintf(fp, "pkglist_query_queue_wait_seconds_total{side=\"feeder\"} %.6f\n",
+	    qs.produceWaitNs / 1e9);
+    fprintf(fp, "pkglist_query_queue_wait_seconds_total{side=\"worker\"} %.6f\n",
+	    qs.consumeWaitNs / 1e9);
+    metric(fp, "pkglist_query_jobs_total", "counter", "Headers processed by each thread.");
+    int nprog = __atomic_load_n(&q->Q.nprog, __ATOMIC_RELAXED);
+    for (int i = 0; i <= nprog; i++) {
+	struct qprog *p = &q->Q.prog[i < nprog ? i : MAXTHREADS];
+	char who[16];
+	if (i < nprog)
+	    snprintf(who, sizeof who, "%d", i);
+	else
+	    strcpy(who, "feeder");
+	fprintf(fp, "pkglist_query_jobs_total{thread=\"%s\"} %llu\n", who,
+		(unsigned long long) __atomic_load_n(&p->jobs, __ATOMIC_RELAXED));
+    }
+}
+
+void pkglistQueryFree(struct pkglistQuery *q)
+{
+    if (!q)
+	return;
+    // A query which has never been started, e.g. only made to check the
+    // format, has no threads to stop, nor any results.
+    if (q->started && !q->finished) {
+	const char *err[2];
+	pkglistQueryFinish(q, err);
+    }
+    for (int i = 0; i < q->nwhere; i++)
+	free(q->where[i].fmt), free(q->where[i].glob);
+    free(q->where);
+    free(q->strip);
+    dedupFree(q->dedup);
+    topFree(q->top);
+    free(q);
+}
+
+// ex:set ts=8 sts=4 sw=4 noet:
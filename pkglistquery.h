@@ -0,0 +1,385 @@
+// Copyright (c) 2017 Alexey Tourbin
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+#include <stdbool.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Run a query over the headers in pkglist files, on a few threads, getting
+// the results in the original order.  The usage is as follows:
+//
+//	q = pkglistQueryNew(fmt, nthreads, cb, arg, err);
+//	for each file:
+//	    pkglistQueryFd(q, fd, err);
+//	pkglistQueryFinish(q, err);
+//	pkglistQueryFree(q);
+//
+// On error, the functions return -1 and fill err[2]: err[0] is usually
+// the name of the function which failed, and err[1] is the message.
+struct pkglistQuery;
+
+// Called with the result of each header, in the original order.  The string
+// is NUL-terminated, and it is only valid during the call: it points right
+// into the buffer returned by headerFormat, no copying is involved.
+// The callback runs under an internal lock, on whichever thread produced
+// the result (the workers or the thread which feeds the query), so it
+// should be reasonably fast and must not call back into the query.
+// A non-zero return stops the query, the pending results being discarded.
+typedef int (*pkglistQueryCallback)(void *arg, const char *str, size_t len);
+
+// Create a query with the headerFormat(3) format.  The query will be run
+// on nthreads worker threads, the thread which calls pkglistQueryFd also
+// taking part, at most PKGLISTQUERY_MAXTHREADS.  The format is checked
+// right away.  Returns NULL on error.
+#define PKGLISTQUERY_MAXTHREADS 64
+struct pkglistQuery *pkglistQueryNew(const char *fmt, int nthreads,
+	pkglistQueryCallback cb, void *arg, const char *err[2]);
+
+// A lower-level interface: instead of formatting each header, run a custom
+// job on the raw header blob.  The job owns the blob and must free(3) it,
+// e.g. by passing it to headerImport(HEADERIMPORT_FAST) and then headerFree.
+// The job returns a malloc'd string, which will be passed to the callback
+// and then freed, or NULL on error, filling err.
+typedef char *(*pkglistQueryJob)(void *blob, unsigned blobSize, void *arg,
+	size_t *lenp, const char *err[2]);
+struct pkglistQuery *pkglistQueryNewJob(pkglistQueryJob job, void *jobArg,
+	int nthreads, pkglistQueryCallback cb, void *arg, const char *err[2]);
+
+// Instead of formatting, pass each header blob to the callback as it
+// appears in a pkglist file, i.e. preceded by the header magic, so that
+// the results can be written out as a new pkglist.  The blob is copied,
+// not re-encoded.  Combined with pkglistQueryWhere, this makes a subset.
+struct pkglistQuery *pkglistQueryNewRaw(int nthreads,
+	pkglistQueryCallback cb, void *arg, const char *err[2]);
+
+// With a raw query, drop the tag from each header, which is then laid
+// out anew, without the tag's data.  This makes slimmer pkglists, for
+// the queries which do not need e.g. the changelogs.  The header digests
+// cover the original header, and will no longer match.  Must be called
+// before the first pkglistQueryFd.
+int pkglistQueryStrip(struct pkglistQuery *q, const char *tag, const char *err[2]);
+
+// Verify the headers against their SHA256HEADER and SHA1HEADER digests,
+// computed over the immutable region.  The result is empty for the good
+// headers, and for the bad ones, "NEVRA\tPROBLEM\n", where the problem
+// is e.g. "SHA1HEADER mismatch", "no digest", "no region", or "malformed
+// header".  The headers are not loaded with librpm.
+struct pkglistQuery *pkglistQueryNewVerify(int nthreads,
+	pkglistQueryCallback cb, void *arg, const char *err[2]);
+
+// Only take the headers which match the condition, "TAG=GLOB": the tag
+// values are matched against the fnmatch(3) glob, and with an array tag,
+// any of the values may match.  With a few conditions, all of them must
+// match.  The headers which do not match get an empty result.  Not for
+// custom jobs.  Must be called before the first pkglistQueryFd.
+int pkglistQueryWhere(struct pkglistQuery *q, const char *cond, const char *err[2]);
+
+// Only format the k headers which rank highest by the tag's value, "TAG",
+// or by the number of its values, "#TAG" (e.g. "#FILENAMES").  Integer
+// values compare as numbers and strings as strings; the headers without
+// the tag are skipped, unless counted.  Each thread keeps the best k headers
+// it has seen, so memory does not grow with the number of headers.  The
+// headers yield empty results as they go, and the winners are passed to
+// the callback by pkglistQueryFinish, best first, ties going in the
+// original order.  Only for pkglistQueryNew, and not with the processes.
+// Must be called before the first pkglistQueryFd.
+int pkglistQueryTop(struct pkglistQuery *q, unsigned k, const char *by, const char *err[2]);
+
+// Run the job only once for the identical headers, such as the noarch
+// packages in the pkglists for different arches, reusing the result.
+// The headers are told apart by a 128-bit hash of the blob.  The job
+// must only depend on the header.  The results are cached up to about
+// budget bytes, after which only the cached ones are reused.  Cannot be
+// combined with the trace or pkglistQueryTop.  Must be called before the
+// first pkglistQueryFd.  The savings are reported by pkglistQueryPrintStats.
+int pkglistQueryDedup(struct pkglistQuery *q, size_t budget, const char *err[2]);
+
+// Record a scheduling trace to fp, one line per header: its ordinal,
+// blob size, decoding and job time, see qsim.c.  Must be called before
+// the first pkglistQueryFd.
+void pkglistQueryTrace(struct pkglistQuery *q, FILE *fp);
+
+// Time the librpm calls made by the format job, on each thread, both
+// by the wall clock and by the thread's CPU time; the difference, given
+// enough cores, is mostly the time spent waiting on locks inside librpm
+// or the allocator.  Also account for the memory held by the blobs, the
+// loaded headers, and the pending results: the current and the peak bytes
+// per stage, and the allocations per thread.  Must be called before the
+// first pkglistQueryFd.
+void pkglistQueryEnableStats(struct pkglistQuery *q);
+
+// Print the statistics, after pkglistQueryFinish; with pkglistQueryDedup,
+// also the savings, even if the stats are not enabled.
+void pkglistQueryPrintStats(struct pkglistQuery *q, FILE *fp);
+
+// Print how far the query has got: the headers fed and done, and the
+// throughput, the queue, and what each thread is up to.  Can be called
+// from another thread at any time while the query is running, e.g. on
+// a signal; the counters are read without taking any locks, so the
+// figures are only roughly consistent with each other.
+void pkglistQueryPrintProgress(struct pkglistQuery *q, FILE *fp);
+
+// Print the counters behind pkglistQueryPrintProgress in the Prometheus
+// text format: the headers and bytes, the waits on the queue, the jobs
+// per thread.  Can be called from another thread, as above.
+void pkglistQueryPrintMetrics(struct pkglistQuery *q, FILE *fp);
+
+// Describe what the query is going to do with each header: the format
+// and the tags it references, the conditions, which of the fast paths
+// and librpm calls apply, and the caches.  Must be called before the
+// first pkglistQueryFd, and after the query is set up.
+void pkglistQueryExplain(struct pkglistQuery *q, FILE *fp);
+
+// Run the job in nthreads forked worker processes instead of the threads,
+// if librpm or the allocator does not scale across the threads.  The blobs
+// and the results go through shared memory, and the callback is run by the
+// thread which calls pkglistQueryFd, still in the original order.  A worker
+// which crashes fails the query.  Cannot be combined with the trace or the
+// stats.  Must be called before the first pkglistQueryFd.
+void pkglistQueryUseProcesses(struct pkglistQuery *q);
+
+// Instead of passing the results to the callback, write them to the file,
+// starting at its current offset, which is left at the end.  The file gets
+// the same bytes as if the results were written out in the original order,
+// but the writes are made in parallel: the offset of each result is the
+// running sum of the sizes before it, computed in order, and the threads
+// then pwrite(2) the results on their own.  The file must be seekable,
+// e.g. a regular file.  Must be called before the first pkglistQueryFd.
+int pkglistQueryOutputFd(struct pkglistQuery *q, int fd, const char *err[2]);
+
+// Back the rings shared with the worker processes by huge pages, which
+// takes the pressure off the TLB, see pkglistHugeMap.  Must be called
+// before the first pkglistQueryFd.
+void pkglistQueryUseHugePages(struct pkglistQuery *q);
+
+// Map a big buffer, e.g. for setvbuf(3), shared with the forked processes
+// or private, backed by huge pages if possible: the reserved ones with
+// MAP_HUGETLB, or else the transparent ones with madvise(2), or else
+// normal pages.  The size is rounded up to the huge page size.  Tells how
+// the buffer is backed, "hugetlb", "thp" (if the kernel grants them), or
+// "4k".  Returns NULL on error, with errno set.
+void *pkglistHugeMap(size_t *sizep, bool shared, const char **howp);
+void pkglistHugeUnmap(void *p, size_t size);
+
+// Feed the headers from a pkglist file (compressed or not) to the query.
+// The results are being passed to the callback as they get ready; some
+// of the results may still be pending when the function returns.
+// The descriptor is closed.  Returns the number of headers read, or -1.
+ssize_t pkglistQueryFd(struct pkglistQuery *q, int fd, const char *err[2]);
+
+// Merging a few pkglists, such as a repository and its overlays, in the
+// order of priority: for each key, only the headers from the first source
+// which has the key are kept.  The first pass picks the winners, cheaply,
+// the keys being taken right from the blobs:
+//
+//	m = pkglistMergeNew(PKGLIST_MERGE_NAME, err);
+//	for each file, in the order of priority:
+//	    pkglistMergeScan(m, fd, err);
+//	for each file, again:
+//	    pkglistQueryFdMerged(q, fd, m, i, err);
+//
+// With PKGLIST_MERGE_NAME, all the packages of a name come from one source;
+// with PKGLIST_MERGE_NEVRA, only the exact duplicates are dropped.
+enum { PKGLIST_MERGE_NAME, PKGLIST_MERGE_NEVRA };
+struct pkglistMerge;
+struct pkglistMerge *pkglistMergeNew(int key, const char *err[2]);
+
+// Scan the next source, the descriptor is closed.  Returns the number
+// of headers, or -1.
+ssize_t pkglistMergeScan(struct pkglistMerge *m, int fd, const char *err[2]);
+
+// The winners from the source (numbered from 0 in the order of the scans),
+// a bitmap over the header ordinals, for *np headers.
+const unsigned char *pkglistMergeKeep(struct pkglistMerge *m, int src, size_t *np);
+
+void pkglistMergeFree(struct pkglistMerge *m);
+
+// Like pkglistQueryFd, for the source which was scanned as src, feeding
+// only the winners.  The file must be the same as scanned.  Returns the
+// number of headers fed, or -1.
+ssize_t pkglistQueryFdMerged(struct pkglistQuery *q, int fd,
+	struct pkglistMerge *m, int src, const char *err[2]);
+
+// A repository loaded into memory: the header blobs from a few pkglists,
+// read and decompressed once, for running many queries over them, e.g.
+// one after another, interactively:
+//
+//	r = pkglistRepoNew(err);
+//	for each file:
+//	    pkglistRepoAdd(r, fd, err);
+//	for each query:
+//	    q = pkglistQueryNew(fmt, nthreads, cb, arg, err);
+//	    pkglistQueryRepo(q, r, NULL, 0, err);
+//	    pkglistQueryFinish(q, err);
+//	    pkglistQueryFree(q);
+//	pkglistRepoFree(r);
+struct pkglistRepo;
+struct pkglistRepo *pkglistRepoNew(const char *err[2]);
+
+// The descriptor is closed.  Returns the number of headers read, or -1.
+ssize_t pkglistRepoAdd(struct pkglistRepo *r, int fd, const char *err[2]);
+
+// The number of the headers, and the bytes of their blobs.
+size_t pkglistRepoCount(struct pkglistRepo *r, size_t *bytesp);
+
+// The header's blob, without the magic, numbered from 0 in the order
+// the headers were added.
+const void *pkglistRepoBlob(struct pkglistRepo *r, size_t i, unsigned *sizep);
+
+// The headers of the package name, as their ordinals, in increasing order.
+// The index by the name is built on the first lookup, and again after more
+// headers are added.  The ordinals are valid until then.  Returns their
+// number, or -1 on error.
+ssize_t pkglistRepoLookup(struct pkglistRepo *r, const char *name,
+	const size_t **idxp, const char *err[2]);
+
+void pkglistRepoFree(struct pkglistRepo *r);
+
+// Like pkglistQueryFd, for the headers in the repository, which are
+// copied, no reading or decompression involved: either those given by
+// their ordinals, or, with idx NULL, all of them.  Returns the number
+// of headers fed, or -1.
+ssize_t pkglistQueryRepo(struct pkglistQuery *q, struct pkglistRepo *r,
+	const size_t *idx, size_t n, const char *err[2]);
+
+// Wait for the pending results and stop the threads.  After this call,
+// the query can only be freed.  Returns 0, or -1 if the query has failed.
+int pkglistQueryFinish(struct pkglistQuery *q, const char *err[2]);
+
+// Release the query, finishing it first if it has been started.
+void pkglistQueryFree(struct pkglistQuery *q);
+
+// The build order of the source packages in a srclist: their build
+// requirements are resolved against the names, provides, and files
+// of the binary packages, which lead back to the sources by SOURCERPM.
+// The version parts of the requirements are not taken into account.
+//
+//	d = pkglistDepsNew(nthreads, err);
+//	for each srclist:
+//	    pkglistDepsAddSources(d, fd, err);
+//	for each pkglist:
+//	    pkglistDepsAddBinaries(d, fd, err);
+//	pkglistDepsOrder(d, cb, arg, err);
+//
+// The headers are decoded and looked into on nthreads threads, as with
+// pkglistQueryNew; the sources must all come before the binaries.
+struct pkglistDeps;
+struct pkglistDeps *pkglistDepsNew(int nthreads, const char *err[2]);
+
+// The descriptor is closed.  Returns the number of headers read, or -1.
+ssize_t pkglistDepsAddSources(struct pkglistDeps *d, int fd, const char *err[2]);
+ssize_t pkglistDepsAddBinaries(struct pkglistDeps *d, int fd, const char *err[2]);
+
+// Called with each strongly connected component of the graph, in the
+// build order, the dependencies first.  With n > 1, the sources (given by
+// their names, in the srclist order) make a cycle, and are to be built
+// together, or bootstrapped.  The steps are numbered from 1.  A non-zero
+// return stops the walk.
+typedef int (*pkglistDepsCallback)(void *arg, unsigned step,
+	const char *const names[], unsigned n);
+
+// Build the graph and walk it.  Also tells the number of the distinct
+// requirements not provided by any binary (rpmlib() ones aside), if
+// unresolved is not NULL.  Returns 0, or -1 on error.
+int pkglistDepsOrder(struct pkglistDeps *d, pkglistDepsCallback cb, void *arg,
+	size_t *unresolved, const char *err[2]);
+
+void pkglistDepsFree(struct pkglistDeps *d);
+
+// The reverse dependencies of the binary packages: what requires
+// a capability or a package, directly or not.  The pkglists are read
+// in one pass, as with pkglistQueryNew, and the graph is built on
+// the first walk, after which more walks are cheap.
+//
+//	r = pkglistRdepsNew(nthreads, err);
+//	for each pkglist:
+//	    pkglistRdepsAdd(r, fd, err);
+//	pkglistRdepsWalk(r, what, 0, cb, arg, err);
+//
+// The requirements are matched against the names, provides, and files
+// of the packages, by the 64-bit hashes of the strings, without the
+// versions.  The rpmlib() requirements are left out.
+struct pkglistRdeps;
+struct pkglistRdeps *pkglistRdepsNew(int nthreads, const char *err[2]);
+
+// The descriptor is closed.  Returns the number of headers read, or -1.
+ssize_t pkglistRdepsAdd(struct pkglistRdeps *r, int fd, const char *err[2]);
+
+// Called with each package found, breadth first, i.e. by the depth.
+// The path goes from the package (path[0]) back to what it was found
+// from (path[n-1]), either the capability or a package of the name,
+// one requirement at a time.  A non-zero return stops the walk.
+typedef int (*pkglistRdepsCallback)(void *arg, unsigned depth,
+	const char *const path[], unsigned n);
+
+// Find what requires what: if there are packages of the name, anything
+// they provide, otherwise the capability.  With maxDepth other than 0,
+// only go that many requirements deep.  Returns the number of the
+// packages found, or -1 on error.
+int pkglistRdepsWalk(struct pkglistRdeps *r, const char *what, unsigned maxDepth,
+	pkglistRdepsCallback cb, void *arg, const char *err[2]);
+
+void pkglistRdepsFree(struct pkglistRdeps *r);
+
+// The file-list diff between two snapshots: the packages are paired
+// by the name, and their file lists compared.
+//
+//	d = pkglistDiffNew(nthreads, err);
+//	for each old pkglist:
+//	    pkglistDiffAddOld(d, fd, err);
+//	for each new pkglist:
+//	    pkglistDiffAddNew(d, fd, err);
+//	pkglistDiffFinish(d, cb, arg, err);
+//
+// The headers are decoded and compared on nthreads threads, as with
+// pkglistQueryNew; a header which is the same in both snapshots, by
+// SHA1HEADER or else by the hash of the blob, is not looked into.
+// With a few packages of the name in the old snapshot, the first one
+// is taken.  The old pkglists must all come before the new ones.
+struct pkglistDiff;
+struct pkglistDiff *pkglistDiffNew(int nthreads, const char *err[2]);
+
+// The descriptor is closed.  Returns the number of headers read, or -1.
+ssize_t pkglistDiffAddOld(struct pkglistDiff *d, int fd, const char *err[2]);
+ssize_t pkglistDiffAddNew(struct pkglistDiff *d, int fd, const char *err[2]);
+
+// Called with each change: op is '+' for a file added to the package,
+// '-' for a file removed from it, and 'm' for a file which has moved
+// to the package from another one, given as from (NULL otherwise).
+// The changes go in the order of the new packages, followed by the old
+// packages which are gone.  A non-zero return stops the walk.
+typedef int (*pkglistDiffCallback)(void *arg, int op, const char *name,
+	const char *file, const char *from);
+
+// Find the moves, and pass the changes to the callback.  Returns 0,
+// or -1 on error.
+int pkglistDiffFinish(struct pkglistDiff *d, pkglistDiffCallback cb, void *arg,
+	const char *err[2]);
+
+void pkglistDiffFree(struct pkglistDiff *d);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,132 @@
+// Copyright (c) 2017 Alexey Tourbin
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Drive the job queue with synthetic jobs, no librpm involved.  The main
+// thread produces blobs at a fixed cost (simulating the decompressor),
+// and the job spins for a fixed cost (simulating headerFormat).  Each blob
+// carries its creation time, which is checked when the string reaches the
+// sink, to get the end-to-end latency distribution.  The queue size NQ
+// is fixed at compile time, see the qbench target in the Makefile.
+
+#define PROG "qbench"
+#include "queue.h"
+#include <time.h>
+#include <getopt.h>
+
+static inline uint64_t now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline void spin(uint64_t ns)
+{
+    if (ns == 0)
+	return;
+    uint64_t end = now() + ns;
+    while (now() < end)
+	;
+}
+
+struct blob {
+    uint64_t t0;
+    unsigned seq;
+};
+
+// The job returns the blob itself as the string, which is zero-cost.
+static char *spinJob(void *blob, unsigned blobSize, void *arg,
+		     size_t *lenp, const char *err[2])
+{
+    (void) err;
+    spin(*(uint64_t *) arg);
+    *lenp = blobSize;
+    return blob;
+}
+
+static uint64_t *lat;
+static unsigned nout;
+
+// Records the latency, also checks that the order is preserved.
+static int latSink(void *arg, char *str, size_t len)
+{
+    (void) arg;
+    struct blob *b = (void *) str;
+    assert(len == sizeof *b);
+    if (b->seq != nout)
+	die("order broken: got %u, expected %u", b->seq, nout);
+    lat[nout++] = now() - b->t0;
+    free(b);
+    return 0;
+}
+
+static struct queue Q;
+
+static int cmp64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned n = 1000000;
+    int nthreads = 1;
+    uint64_t jobCost = 0, prodCost = 0;
+    int c;
+    while ((c = getopt(argc, argv, "n:t:c:p:")) != -1) {
+	switch (c) {
+	case 'n': n = strtoul(optarg, NULL, 0); break;
+	case 't': nthreads = atoi(optarg); break;
+	case 'c': jobCost = strtoull(optarg, NULL, 0); break;
+	case 'p': prodCost = strtoull(optarg, NULL, 0); break;
+	default:
+	    fprintf(stderr, "Usage: " PROG " [-n JOBS] [-t THREADS] [-c JOB_NS] [-p PRODUCER_NS]\n");
+	    return 1;
+	}
+    }
+    if (n < 1 || nthreads < 1 || nthreads > MAXTHREADS)
+	die("bad arguments");
+    lat = malloc(n * sizeof *lat);
+    if (!lat) die("%s: %m", "malloc");
+    uint64_t t0 = now();
+    start(&Q, nthreads, spinJob, &jobCost, latSink, NULL, NULL);
+    for (unsigned i = 0; i < n; i++) {
+	spin(prodCost);
+	struct blob *b = malloc(sizeof *b);
+	if (!b) die("%s: %m", "malloc");
+	b->t0 = now(), b->seq = i;
+	processBlob(&Q, b, sizeof *b);
+    }
+    finish(&Q);
+    uint64_t t = now() - t0;
+    assert(nout == n);
+    qsort(lat, n, sizeof *lat, cmp64);
+#define P(q) lat[(size_t)((n - 1) * (q))]
+    printf("NQ=%d threads=%d job=%lluns prod=%lluns: %.1f ns/handoff, "
+	   "latency p50=%llu p99=%llu p99.9=%llu max=%llu ns\n",
+	   NQ, nthreads, (unsigned long long) jobCost, (unsigned long long) prodCost,
+	   (double) t / n, (unsigned long long) P(0.5), (unsigned long long) P(0.99),
+	   (unsigned long long) P(0.999), (unsigned long long) lat[n-1]);
+    return 0;
+}
+
+// ex:set ts=8 sts=4 sw=4 noet:
@@ -0,0 +1,254 @@
+// Copyright (c) 2017 Alexey Tourbin
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Replay a trace recorded with pkglist-query --trace against the scheduler,
+// with the queue parameters and the aid policy as the knobs, and predict
+// the makespan and the idle time.  The simulation follows queue.h closely:
+// the main thread decodes the blobs and pushes them to the queue, helping
+// the workers according to the policy, while the workers pick the blobs
+// in order.  Synchronization costs are not modelled.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#define PROG "qsim"
+#define warn(fmt, args...) fprintf(stderr, "%s: " fmt "\n", PROG, ##args)
+#define die(fmt, args...) warn(fmt, ##args), exit(128) // like git
+
+struct rec {
+    unsigned ord;
+    unsigned size;
+    uint64_t decode;
+    uint64_t format;
+};
+
+static int cmpOrd(const void *a, const void *b)
+{
+    const struct rec *x = a, *y = b;
+    return (x->ord > y->ord) - (x->ord < y->ord);
+}
+
+static struct rec *R;
+static size_t N;
+
+static void load(FILE *fp)
+{
+    size_t alloc = 0;
+    unsigned ord, size;
+    unsigned long long decode, format;
+    while (fscanf(fp, "%u %u %llu %llu", &ord, &size, &decode, &format) == 4) {
+	if (N == alloc) {
+	    alloc = alloc ? 2 * alloc : 4096;
+	    R = realloc(R, alloc * sizeof *R);
+	    if (!R) die("%s: %m", "realloc");
+	}
+	R[N++] = (struct rec) { ord, size, decode, format };
+    }
+    if (!feof(fp))
+	die("malformed trace");
+    // The workers write their records in completion order.
+    qsort(R, N, sizeof *R, cmpOrd);
+}
+
+// The knobs, the defaults are the same as in queue.h.
+static int nq = 128, minblob = 16;
+static size_t minbytes = 128 << 10;
+static int nthreads = 1;
+static enum { POLICY_AID, POLICY_FULL, POLICY_NONE } policy;
+
+// The queue: the entries in [head, tail) are in the queue, of which
+// [firstBlob, tail) are still blobs, because the blobs are always
+// taken in order.  The rest are either cooking or done.
+static size_t head, firstBlob, tail;
+static size_t blobBytes;
+static bool *done;
+
+#define MAXTHREADS 64
+static struct {
+    uint64_t busyUntil;
+    size_t job;
+    bool busy;
+    uint64_t idleSince;
+    uint64_t idle;
+} W[MAXTHREADS];
+
+// The main thread's clock and accounting.
+static uint64_t tm, mainDecode, mainAid, mainWait;
+
+static void flush(void)
+{
+    while (head < firstBlob && done[head])
+	head++;
+}
+
+// A worker takes the next blob, if any, at time t.
+static void take(int i, uint64_t t)
+{
+    if (firstBlob == tail) {
+	W[i].busy = false, W[i].idleSince = t;
+	return;
+    }
+    size_t j = firstBlob++;
+    blobBytes -= R[j].size;
+    if (!W[i].busy)
+	W[i].idle += t - W[i].idleSince;
+    W[i].busy = true, W[i].job = j, W[i].busyUntil = t + R[j].format;
+}
+
+// Complete the worker jobs up to time t, in the order of completion.
+static void advance(uint64_t t)
+{
+    while (1) {
+	int k = -1;
+	for (int i = 0; i < nthreads; i++)
+	    if (W[i].busy && W[i].busyUntil <= t &&
+		    (k < 0 || W[i].busyUntil < W[k].busyUntil))
+		k = i;
+	if (k < 0)
+	    break;
+	done[W[k].job] = true;
+	flush();
+	take(k, W[k].busyUntil);
+    }
+}
+
+// The earliest completion time, to wait for.
+static uint64_t nextCompletion(void)
+{
+    uint64_t t = UINT64_MAX;
+    for (int i = 0; i < nthreads; i++)
+	if (W[i].busy && W[i].busyUntil < t)
+	    t = W[i].busyUntil;
+    return t;
+}
+
+static void aid(void)
+{
+    size_t j = firstBlob++;
+    blobBytes -= R[j].size;
+    tm += R[j].format, mainAid += R[j].format;
+    advance(tm);
+    done[j] = true;
+    flush();
+}
+
+static void waitWorker(void)
+{
+    uint64_t t = nextCompletion();
+    if (t == UINT64_MAX)
+	die("deadlock");
+    mainWait += t - tm, tm = t;
+    advance(tm);
+}
+
+static bool needMoreAid(void)
+{
+    size_t nblob = tail - firstBlob;
+    if (blobBytes < minbytes)
+	return false;
+    if (nblob < (size_t) minblob * 3 / 4)
+	return false;
+    if (R[firstBlob].size > blobBytes / minblob)
+	return false;
+    return true;
+}
+
+static void simulate(void)
+{
+    for (size_t i = 0; i < N; i++) {
+	tm += R[i].decode, mainDecode += R[i].decode;
+	advance(tm);
+	while (tail - head == (size_t) nq) {
+	    if (policy != POLICY_NONE && tail - firstBlob >= 2)
+		aid();
+	    else
+		waitWorker();
+	}
+	tail++, blobBytes += R[i].size;
+	for (int k = 0; k < nthreads && firstBlob < tail; k++)
+	    if (!W[k].busy)
+		take(k, tm);
+	if (policy == POLICY_AID)
+	    while (needMoreAid())
+		aid();
+    }
+    // Finish.
+    if (policy != POLICY_NONE)
+	while (firstBlob < tail)
+	    aid();
+    while (head < tail)
+	waitWorker();
+}
+
+int main(int argc, char **argv)
+{
+    int c;
+    while ((c = getopt(argc, argv, "t:n:b:B:p:")) != -1) {
+	switch (c) {
+	case 't': nthreads = atoi(optarg); break;
+	case 'n': nq = atoi(optarg); break;
+	case 'b': minblob = atoi(optarg); break;
+	case 'B': minbytes = strtoul(optarg, NULL, 0); break;
+	case 'p':
+	    if (strcmp(optarg, "aid") == 0) policy = POLICY_AID;
+	    else if (strcmp(optarg, "full") == 0) policy = POLICY_FULL;
+	    else if (strcmp(optarg, "none") == 0) policy = POLICY_NONE;
+	    else die("unknown policy: %s", optarg);
+	    break;
+	default:
+usage:	    fprintf(stderr, "Usage: " PROG " [-t THREADS] [-n NQ] [-b MINBLOB] [-B MINBYTES]"
+			    " [-p aid|full|none] [TRACE]\n");
+	    return 1;
+	}
+    }
+    if (nthreads < 1 || nthreads > MAXTHREADS || nq < 2 || minblob < 1)
+	goto usage;
+    argc -= optind, argv += optind;
+    FILE *fp = stdin;
+    if (argc > 0 && !(fp = fopen(argv[0], "r")))
+	die("%s: %m", argv[0]);
+    load(fp);
+    if (N == 0)
+	die("empty trace");
+    done = calloc(N, sizeof *done);
+    if (!done) die("%s: %m", "calloc");
+    simulate();
+    uint64_t makespan = tm, idle = 0, work = 0;
+    for (int i = 0; i < nthreads; i++)
+	idle += W[i].idle + (makespan - W[i].idleSince);
+    for (size_t i = 0; i < N; i++)
+	work += R[i].decode + R[i].format;
+#define MS(ns) ((ns) / 1e6)
+    printf("threads=%d NQ=%d MINBLOB=%d MINBYTES=%zu policy=%s: "
+	   "makespan %.3f ms (serial %.3f ms, speedup %.2f), "
+	   "main: decode %.3f aid %.3f wait %.3f ms, workers idle %.3f ms (%.1f%%)\n",
+	   nthreads, nq, minblob, minbytes,
+	   policy == POLICY_AID ? "aid" : policy == POLICY_FULL ? "full" : "none",
+	   MS(makespan), MS(work), (double) work / makespan,
+	   MS(mainDecode), MS(mainAid), MS(mainWait),
+	   MS(idle), 100.0 * idle / (nthreads * makespan));
+    return 0;
+}
+
+// ex:set ts=8 sts=4 sw=4 noet:
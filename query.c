@@ -18,359 +18,881 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+
+#define PROG "pkglist-query"
+#define warn(fmt, args...) fprintf(stderr, "%s: " fmt "\n", PROG, ##args)
+#define die(fmt, args...) warn(fmt, ##args), exit(128) // like git
+
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
-#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pkglistquery.h"
+
+// The bytes of output, for the metrics.
+static uint64_t outputBytes;
+
+// Print the strings.
+static int print(void *arg, const char *str, size_t len)
+{
+    (void) arg;
+    if (fwrite_unlocked(str, 1, len, stdout) != len)
+	die("%s: %m", "fwrite");
+    __atomic_store_n(&outputBytes, outputBytes + len, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// With --verify, the problems are printed along with the header's ordinal
+// number, counting from 1 across all the pkglists.
+static unsigned long nverified, nbad;
+
+static int report(void *arg, const char *str, size_t len)
+{
+    (void) arg;
+    nverified++;
+    if (len) {
+	nbad++;
+	printf("%lu\t%s", nverified, str);
+    }
+    return 0;
+}
+
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
 #include <pthread.h>
-#include <rpm/rpmlib.h>
-
-// A thread-safe strerror(3) replacement.
-static const char *xstrerror(int errnum)
-{
-    // Some of the great minds say that sys_errlist is deprecated.
-    // Well, at least it's thread-safe, and it does not deadlock.
-    if (errnum > 0 && errnum < sys_nerr)
-	return sys_errlist[errnum];
-    return "Unknown error";
-}
-
-// A job queue entry which needs to be processed: the header blob has to be
-// loaded, queried, and the formatted output string put back to str, with
-// the stage updated accordingly.  The strings then will be picked up and
-// printed in the original order.
-struct qent {
-    union { void *blob; uintptr_t cookie; char *str; };
-    union { unsigned blobSize; unsigned len; };
-    enum { STAGE_BLOB, STAGE_COOKING, STAGE_STR } stage;
-};
+#include <sys/resource.h>
+#include <zpkglist.h>
 
-// The maximum number of entries in the job queue.
-// Good parallelism can be achieved only with a somewhat big queue:
-// - src.rpm headers can be as small as 1K, while zstd decompression
-//   operates in 128K chunks; see also MINBYTES below;
-// - on the other hand, a big header (e.g. with many %{Filenames}) can
-//   take a lot of time to headerFormat, and if the second thread fills
-//   the remaining slots quickly, the only alternative for it is to stall.
-#define NQ 128
-
-// The job queue.
-struct {
-    pthread_mutex_t mutex;
-    pthread_cond_t can_produce;
-    pthread_cond_t can_consume;
-    // An ever increasing sequence number used as a cookie.
-    uintptr_t seq;
-    // The sum of the blob sizes of STAGE_BLOB entries.
-    size_t blobBytes;
-    // The total number of STAGE_BLOB entries in the queue.
-    int nblob;
-    int nq;
-    struct qent q[NQ];
-} Q = {
-    PTHREAD_MUTEX_INITIALIZER,
-    PTHREAD_COND_INITIALIZER,
-    PTHREAD_COND_INITIALIZER,
+// With --rewrite, the header blobs are piped to the compressor, which runs
+// on its own thread, overlapping with the query.
+struct compressor {
+    int pipe[2];
+    int out;
+    pthread_t thread;
+    int rc;
+    const char *err[2];
 };
 
-#define PROG "pkglist-query"
-#define warn(fmt, args...) fprintf(stderr, "%s: " fmt "\n", PROG, ##args)
-#define die(fmt, args...) warn(fmt, ##args), exit(128) // like git
+static void *compressor(void *arg)
+{
+    struct compressor *z = arg;
+    z->rc = zpkglistCompress(z->pipe[0], z->out, z->err, NULL, NULL);
+    close(z->pipe[0]);
+    return NULL;
+}
 
-// Search a blob in Q.q starting with qe.
-static inline struct qent *findBlob(struct qent *qe)
+// Write the blobs to the pipe; the filtered out headers are empty.
+static int writeBlob(void *arg, const char *str, size_t len)
 {
-    // Cf. Quicker sequential search in [Knuth, Vol.3, p.398].
-    while (1) {
-	if (qe[0].stage == STAGE_BLOB) break;
-	if (qe[1].stage == STAGE_BLOB) { qe += 1; break; }
-	if (qe[2].stage == STAGE_BLOB) { qe += 2; break; }
-	if (qe[3].stage == STAGE_BLOB) { qe += 3; break; }
-	qe += 4;
-    }
-    return qe;
-}
-
-// After formatting is done, put the string back and flush the queue,
-// picking up earlier strings and printing them in the original order.
-void putBack(uintptr_t cookie, char *str, size_t len)
-{
-    int i;
-    // Flush the queue.
-    for (i = 0; i < Q.nq; i++) {
-	struct qent *qe = &Q.q[i];
-	if (qe->stage == STAGE_STR) {
-	    if (fwrite_unlocked(qe->str, 1, qe->len, stdout) != qe->len)
-		die("%s: %m", "fwrite");
-	    free(qe->str);
+    struct compressor *z = arg;
+    __atomic_store_n(&outputBytes, outputBytes + len, __ATOMIC_RELAXED);
+    while (len) {
+	ssize_t n = write(z->pipe[1], str, len);
+	if (n < 0) {
+	    if (errno == EINTR)
+		continue;
+	    // The compressor has failed, its error is reported.
+	    if (errno == EPIPE)
+		return 1;
+	    die("%s: %m", "write");
 	}
-	else if (qe->cookie == cookie) {
-	    if (fwrite_unlocked(str, 1, len, stdout) != len)
-		die("%s: %m", "fwrite");
-	    free(str);
-	    str = NULL;
-	}
-	else
-	    break;
+	str += n, len -= n;
     }
-    // Advance the queue.
-    Q.nq -= i;
-    memmove(Q.q, Q.q + i, Q.nq * sizeof(struct qent));
-    // Was it put back?
-    if (str == NULL)
+    return 0;
+}
+
+// On SIGUSR1, the query's progress is printed to stderr.  The signal
+// is blocked in all the threads and taken with sigwait on a thread of its
+// own, so that it never interrupts the workers and the report can use stdio.
+static sigset_t usr1;
+static pthread_mutex_t progressMutex = PTHREAD_MUTEX_INITIALIZER;
+static struct pkglistQuery *progressQuery;
+
+// Must be called before any threads are created, for them to inherit the mask.
+static void blockProgress(void)
+{
+    sigemptyset(&usr1);
+    sigaddset(&usr1, SIGUSR1);
+    int rc = pthread_sigmask(SIG_BLOCK, &usr1, NULL);
+    if (rc)
+	die("%s: %s", "pthread_sigmask", strerror(rc));
+}
+
+// With --metrics-file, the metrics are written in the Prometheus text
+// format, for node_exporter's textfile collector: at the exit, with the
+// exit code, and also every --metrics-interval seconds while the query
+// runs.  The file is written anew and renamed over the old one, so that
+// the collector never sees it half-written.
+static const char *metricsFile;
+static unsigned metricsInterval;
+static uint64_t startNs;
+enum { STAGE_MERGE, STAGE_FEED, STAGE_FINISH, NSTAGES };
+static const char *stageNames[NSTAGES] = { "merge", "feed", "finish" };
+static uint64_t stageNs[NSTAGES];
+// The query's own metrics, saved before it is freed.
+static char *queryMetrics;
+
+static uint64_t clockNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void stageDone(int stage, uint64_t t0)
+{
+    __atomic_store_n(&stageNs[stage], clockNs() - t0, __ATOMIC_RELAXED);
+}
+
+// Called under progressMutex.  The status is the exit code, or -1 while
+// still running.  The failures are only warned about.
+static void writeMetrics(int status)
+{
+    char tmp[4096];
+    snprintf(tmp, sizeof tmp, "%s.%d.tmp", metricsFile, (int) getpid());
+    FILE *fp = fopen(tmp, "w");
+    if (!fp) {
+	warn("%s: %m", tmp);
 	return;
-    // Still need to put back.
-    struct qent *qe = Q.q + 1;
-    while (1) {
-	if (qe[0].cookie == cookie) break;
-	if (qe[1].cookie == cookie) { qe += 1; break; }
-	if (qe[2].cookie == cookie) { qe += 2; break; }
-	if (qe[3].cookie == cookie) { qe += 3; break; }
-	qe += 4;
     }
-    qe->str = str;
-    assert(len < ~0U);
-    qe->len = len;
-    qe->stage = STAGE_STR;
+    fprintf(fp, "# HELP pkglist_query_run_seconds Time since the start.\n"
+	    "# TYPE pkglist_query_run_seconds gauge\n"
+	    "pkglist_query_run_seconds %.6f\n", (clockNs() - startNs) / 1e9);
+    fprintf(fp, "# HELP pkglist_query_stage_seconds Time spent in each stage, once it is over.\n"
+	    "# TYPE pkglist_query_stage_seconds gauge\n");
+    for (int i = 0; i < NSTAGES; i++)
+	fprintf(fp, "pkglist_query_stage_seconds{stage=\"%s\"} %.6f\n", stageNames[i],
+		__atomic_load_n(&stageNs[i], __ATOMIC_RELAXED) / 1e9);
+    fprintf(fp, "# HELP pkglist_query_output_bytes_total Bytes of output.\n"
+	    "# TYPE pkglist_query_output_bytes_total counter\n"
+	    "pkglist_query_output_bytes_total %llu\n",
+	    (unsigned long long) __atomic_load_n(&outputBytes, __ATOMIC_RELAXED));
+    if (progressQuery)
+	pkglistQueryPrintMetrics(progressQuery, fp);
+    else if (queryMetrics)
+	fputs(queryMetrics, fp);
+    // With --procs, the workers count once they are reaped.
+    struct rusage self, children;
+    getrusage(RUSAGE_SELF, &self);
+    getrusage(RUSAGE_CHILDREN, &children);
+    fprintf(fp, "# HELP pkglist_query_peak_rss_bytes Peak resident set size.\n"
+	    "# TYPE pkglist_query_peak_rss_bytes gauge\n"
+	    "pkglist_query_peak_rss_bytes{process=\"self\"} %lld\n"
+	    "pkglist_query_peak_rss_bytes{process=\"children\"} %lld\n",
+	    (long long) self.ru_maxrss << 10, (long long) children.ru_maxrss << 10);
+    if (status >= 0)
+	fprintf(fp, "# HELP pkglist_query_exit_code The exit code of the run.\n"
+		"# TYPE pkglist_query_exit_code gauge\n"
+		"pkglist_query_exit_code %d\n"
+		"# HELP pkglist_query_last_run_timestamp_seconds When the run ended.\n"
+		"# TYPE pkglist_query_last_run_timestamp_seconds gauge\n"
+		"pkglist_query_last_run_timestamp_seconds %lld\n",
+		status, (long long) time(NULL));
+    if (fclose(fp) || rename(tmp, metricsFile)) {
+	warn("%s: %m", metricsFile);
+	unlink(tmp);
+    }
 }
 
-// This routine is executed by the helper thread.
-void *worker(void *fmt)
+// Registered with on_exit, which also gets the exit code of die().
+static void exitMetrics(int status, void *arg)
 {
-    uintptr_t cookie = 0;
-    char *str = NULL;
-    size_t len = 0;
+    (void) arg;
+    pthread_mutex_lock(&progressMutex);
+    writeMetrics(status);
+    pthread_mutex_unlock(&progressMutex);
+}
+
+static void *progress(void *arg)
+{
+    (void) arg;
     while (1) {
-	// Lock the mutex.
-	int err = pthread_mutex_lock(&Q.mutex);
-	if (err) die("%s: %s", "pthread_mutex_lock", xstrerror(err));
-	// See if they're possibly waiting to produce.
-	bool waiting = Q.nq == NQ;
-	// Put back the job from the previous iteration.
-	if (str) {
-	    putBack(cookie, str, len);
-	    cookie = 0, str = NULL, len = 0;
+	int sig;
+	if (metricsInterval) {
+	    struct timespec ts = { metricsInterval, 0 };
+	    sig = sigtimedwait(&usr1, NULL, &ts);
+	    if (sig < 0 && errno != EAGAIN)
+		continue;
 	}
-	// If they're possibly waiting to produce, let them know.
-	if (waiting && Q.nq < NQ) {
-	    err = pthread_cond_signal(&Q.can_produce);
-	    if (err) die("%s: %s", "pthread_cond_signal", xstrerror(err));
+	else if (sigwait(&usr1, &sig))
+	    continue;
+	pthread_mutex_lock(&progressMutex);
+	if (progressQuery && sig == SIGUSR1)
+	    pkglistQueryPrintProgress(progressQuery, stderr);
+	else if (progressQuery)
+	    writeMetrics(-1);
+	else if (sig == SIGUSR1)
+	    warn("no progress to report");
+	pthread_mutex_unlock(&progressMutex);
+    }
+    return NULL;
+}
+
+// Started in every mode, before any other threads, so that SIGUSR1
+// never kills the process; only the queries have the progress to report.
+static void startProgress(void)
+{
+    blockProgress();
+    pthread_t thread;
+    int rc = pthread_create(&thread, NULL, progress, NULL);
+    if (rc)
+	die("%s: %s", "pthread_create", strerror(rc));
+    pthread_detach(thread);
+}
+
+// The query is set up and about to run.
+static void watchProgress(struct pkglistQuery *q)
+{
+    pthread_mutex_lock(&progressMutex);
+    progressQuery = q;
+    pthread_mutex_unlock(&progressMutex);
+}
+
+// The query is about to be freed.  Not to die under the mutex, which
+// exitMetrics takes, the query's metrics are only warned about and dropped.
+static void stopProgress(void)
+{
+    pthread_mutex_lock(&progressMutex);
+    if (metricsFile) {
+	size_t size;
+	FILE *fp = open_memstream(&queryMetrics, &size);
+	if (!fp)
+	    warn("%s: %m", "open_memstream");
+	else {
+	    pkglistQueryPrintMetrics(progressQuery, fp);
+	    if (fclose(fp)) {
+		warn("%s: %m", "open_memstream");
+		free(queryMetrics);
+		queryMetrics = NULL;
+	    }
 	}
-	// Try to fetch a blob from the queue.
-	void *blob;
-	unsigned blobSize;
-	while (1) {
-	    if (Q.nblob) {
-		struct qent *qe = findBlob(Q.q);
-		blob = qe->blob;
-		blobSize = qe->blobSize;
-		// Make an odd cookie so that it never equals
-		// an aligned pointer such as malloc'd blob or str.
-		cookie = qe->cookie = (Q.seq++, Q.seq++);
-		qe->stage = STAGE_COOKING;
-		Q.nblob--, Q.blobBytes -= blobSize;
+    }
+    progressQuery = NULL;
+    pthread_mutex_unlock(&progressMutex);
+}
+
+// With --huge-pages, the size of the stdout buffer.
+#define HUGEBUF (4 << 20)
+
+#include <fcntl.h> // O_RDONLY
+
+// With --fanout, the records (the output of a header, in full) are
+// spread over the stdin pipes of N copies of a command, either in turn,
+// or by the hash of the record's first field.  The pipes are non-blocking
+// and each has a buffer of its own, so that a slow consumer only holds
+// back the records bound for it, until its buffer fills up.
+#include <spawn.h>
+#include <poll.h>
+#include <sys/wait.h>
+
+extern char **environ;
+
+struct consumer {
+    pid_t pid;
+    int fd;
+    char *buf;
+    size_t off, len, alloc;
+    unsigned long records, waits;
+    uint64_t bytes;
+};
+
+// A record is only given to a consumer with less than this much pending.
+#define FANOUTBUF (1 << 20)
+
+static struct consumer *consumers;
+static unsigned nconsumers, nextConsumer;
+static bool fanoutKey;
+static const char *fanoutCmd;
+
+static void startFanout(unsigned n, char **cmd)
+{
+    consumers = calloc(n, sizeof *consumers);
+    if (!consumers)
+	die("%s: %m", "calloc");
+    // The consumers get the default signal handling, whatever ours is.
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    sigset_t set;
+    sigemptyset(&set);
+    posix_spawnattr_setsigmask(&attr, &set);
+    sigaddset(&set, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attr, &set);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+    for (unsigned i = 0; i < n; i++) {
+	struct consumer *c = &consumers[i];
+	int fd[2];
+	if (pipe(fd))
+	    die("%s: %m", "pipe");
+	// Close-on-exec, for the consumers not to hold each other's pipes;
+	// there are no other threads yet to race with.
+	if (fcntl(fd[0], F_SETFD, FD_CLOEXEC) || fcntl(fd[1], F_SETFD, FD_CLOEXEC))
+	    die("%s: %m", "fcntl");
+	posix_spawn_file_actions_t fa;
+	posix_spawn_file_actions_init(&fa);
+	posix_spawn_file_actions_adddup2(&fa, fd[0], 0);
+	int rc = posix_spawnp(&c->pid, cmd[0], &fa, &attr, cmd, environ);
+	posix_spawn_file_actions_destroy(&fa);
+	if (rc)
+	    die("%s: %s", cmd[0], strerror(rc));
+	close(fd[0]);
+	if (fcntl(fd[1], F_SETFL, O_NONBLOCK))
+	    die("%s: %m", "fcntl");
+	c->fd = fd[1];
+    }
+    posix_spawnattr_destroy(&attr);
+    nconsumers = n;
+    fanoutCmd = cmd[0];
+    signal(SIGPIPE, SIG_IGN);
+}
+
+// Write as much as the pipe takes.  Returns the number of bytes written.
+static size_t pipeWrite(struct consumer *c, const char *str, size_t len)
+{
+    size_t done = 0;
+    while (done < len) {
+	ssize_t n = write(c->fd, str + done, len - done);
+	if (n < 0) {
+	    if (errno == EINTR)
+		continue;
+	    if (errno == EAGAIN)
 		break;
-	    }
-	    // Wait until something is queued.
-	    err = pthread_cond_wait(&Q.can_consume, &Q.mutex);
-	    if (err) die("%s: %s", "pthread_cond_wait", xstrerror(err));
+	    if (errno == EPIPE)
+		die("%s: consumer %u exited early", fanoutCmd, (unsigned) (c - consumers));
+	    die("%s: %m", "write");
 	}
-	// Got a blob, unlock the mutex.
-	err = pthread_mutex_unlock(&Q.mutex);
-	if (err) die("%s: %s", "pthread_mutex_unlock", xstrerror(err));
-	// Handle the end of the queue.
-	if (blob == NULL)
-	    return NULL;
-	// Do the job.
-	Header h = headerImport(blob, blobSize, HEADERIMPORT_FAST);
-	if (!h) die("headerImport: import failed");
-	const char *fmterr = "format failed";
-	str = headerFormat(h, fmt, &fmterr);
-	if (!str) die("headerFormat: %s", fmterr);
-	// The blob is freed on behalf of headerFree.
-	headerFree(h);
-	len = strlen(str);
-    }
-}
-
-// Check if the worker needs aid from the main thread.
-struct qent *needAid1(void)
-{
-    if (Q.nblob < 1)
-	return NULL;
-    return findBlob(Q.q);
-}
-
-// If there are at least two blobs, returns the first one.
-struct qent *needAid2(void)
-{
-    if (Q.nblob < 2)
-	return NULL;
-    return findBlob(Q.q);
-}
-
-// If the number of blobs in the queue is roughly below this size,
-// the main thread will keep pumping up the queue with new blobs.
-// Otherwise, the main thread will also consider the possibility of
-// helping the worker thread to cope with the already loaded blobs.
-#define MINBLOB 16
-// Also, because decompressors operate in chunks, the total byte count
-// shouldn't drop much below the chunk size.
-#define MINBYTES (128<<10)
-
-static_assert(MINBLOB >= 4, "MINBLOB is not too small");
-static_assert(NQ >= 2 * MINBLOB, "NQ is not too small");
-
-// An advanced strategy for the main thread.
-struct qent *needMoreAid(void)
-{
-    // Too few bytes left?  Time to recharge the decompressor.
-    if (Q.blobBytes < MINBYTES)
-	return NULL;
-    // Too few blobs?
-    if (Q.nblob < MINBLOB * 3 / 4)
-	return NULL;
-    struct qent *qe = findBlob(Q.q);
-    // The blob shouldn't be too big, as compared to other blobs.
-    // But note that we're averaging over MINBLOB, not Q.nblob.
-    // This means that, if the blob seems too big for now, it might
-    // be taken next time, after the main thread pushes another blob.
-    if (qe->blobSize > Q.blobBytes / MINBLOB)
-	return NULL;
-    return qe;
-}
-
-// The main thread then can help the worker.
-void aid(struct qent *qe, const char *fmt)
-{
-    void *blob = qe->blob;
-    unsigned blobSize = qe->blobSize;
-    // We're under the same lock as needAid(),
-    // complete the transition to the cooking stage.
-    uintptr_t cookie = qe->cookie = (Q.seq++, Q.seq++);
-    qe->stage = STAGE_COOKING;
-    Q.nblob--, Q.blobBytes -= blobSize;
-    // Unlock the mutex.
-    int err = pthread_mutex_unlock(&Q.mutex);
-    if (err) die("%s: %s", "pthread_mutex_unlock", xstrerror(err));
-    // Do the job.
-    Header h = headerImport(blob, blobSize, HEADERIMPORT_FAST);
-    if (!h) die("headerImport: import failed");
-    const char *fmterr = "format failed";
-    char *str = headerFormat(h, fmt, &fmterr);
-    if (!str) die("headerFormat: %s", fmterr);
-    headerFree(h);
-    size_t len = strlen(str);
-    // Lock the mutex.
-    err = pthread_mutex_lock(&Q.mutex);
-    if (err) die("%s: %s", "pthread_mutex_lock", xstrerror(err));
-    // Put back.
-    putBack(cookie, str, len);
-}
-
-// Dispatch the blob, called from the main thread.
-void processBlob(void *blob, unsigned blobSize, const char *fmt)
-{
-    // Lock the mutex.
-    int err = pthread_mutex_lock(&Q.mutex);
-    if (err) die("%s: %s", "pthread_mutex_lock", xstrerror(err));
-    // Try to help while the queue is full.  But we also need
-    // to keep the worker busy while decoding the next blob,
-    // so don't grab the very last one.
-    while (Q.nq == NQ) {
-	struct qent *qe = needAid2();
-	if (qe) {
-	    aid(qe, fmt);
+	done += n;
+    }
+    return done;
+}
+
+static void flushPending(struct consumer *c)
+{
+    c->off += pipeWrite(c, c->buf + c->off, c->len - c->off);
+    if (c->off == c->len)
+	c->off = c->len = 0;
+}
+
+// Wait for any of the consumers to take some of their pending output,
+// or only for c, if it is given.
+static void waitConsumers(struct consumer *only)
+{
+    struct pollfd pfd[nconsumers];
+    struct consumer *cc[nconsumers];
+    unsigned n = 0;
+    for (unsigned i = 0; i < nconsumers; i++) {
+	struct consumer *c = &consumers[i];
+	if ((only && c != only) || c->off == c->len)
 	    continue;
-	}
-	// Wait until the queue is flushed.
-	err = pthread_cond_wait(&Q.can_produce, &Q.mutex);
-	if (err) die("%s: %s", "pthread_cond_wait", xstrerror(err));
-    }
-    // Put the blob to the queue.
-    Q.q[Q.nq++] = (struct qent) { { blob }, { blobSize }, STAGE_BLOB };
-    Q.nblob++, Q.blobBytes += blobSize;
-    // If they're possibly waiting to consume, let them know.
-    if (Q.nblob == 1) {
-	err = pthread_cond_signal(&Q.can_consume);
-	if (err) die("%s: %s", "pthread_cond_signal", xstrerror(err));
-    }
-    // See if more help is desirable.
+	pfd[n] = (struct pollfd) { c->fd, POLLOUT, 0 };
+	cc[n++] = c;
+	c->waits++;
+    }
+    while (poll(pfd, n, -1) < 0)
+	if (errno != EINTR)
+	    die("%s: %m", "poll");
+    for (unsigned i = 0; i < n; i++)
+	if (pfd[i].revents)
+	    flushPending(cc[i]);
+}
+
+static struct consumer *pickConsumer(const char *str, size_t len)
+{
+    if (fanoutKey) {
+	// FNV-1a of the first field, up to a tab or the end of the line.
+	uint64_t h = 0xcbf29ce484222325ULL;
+	for (size_t i = 0; i < len && str[i] != '\t' && str[i] != '\n'; i++)
+	    h = (h ^ (unsigned char) str[i]) * 0x100000001b3ULL;
+	struct consumer *c = &consumers[h % nconsumers];
+	while (c->len - c->off >= FANOUTBUF)
+	    waitConsumers(c);
+	return c;
+    }
+    // In turn, passing over the consumers which are behind.
     while (1) {
-	struct qent *qe = needMoreAid();
-	if (!qe)
-	    break;
-	aid(qe, fmt);
+	for (unsigned k = 0; k < nconsumers; k++) {
+	    unsigned i = (nextConsumer + k) % nconsumers;
+	    struct consumer *c = &consumers[i];
+	    if (c->len - c->off >= FANOUTBUF)
+		flushPending(c);
+	    if (c->len - c->off < FANOUTBUF) {
+		nextConsumer = i + 1;
+		return c;
+	    }
+	}
+	waitConsumers(NULL);
+    }
+}
+
+// The sink: the records go out whole, each to one of the consumers.
+static int fanout(void *arg, const char *str, size_t len)
+{
+    (void) arg;
+    if (len == 0)
+	return 0;
+    __atomic_store_n(&outputBytes, outputBytes + len, __ATOMIC_RELAXED);
+    struct consumer *c = pickConsumer(str, len);
+    c->records++;
+    c->bytes += len;
+    // With nothing pending, most of the record usually goes right into the pipe.
+    if (c->off == c->len) {
+	size_t n = pipeWrite(c, str, len);
+	str += n, len -= n;
     }
-    // Unlock the mutex.
-    err = pthread_mutex_unlock(&Q.mutex);
-    if (err) die("%s: %s", "pthread_mutex_unlock", xstrerror(err));
+    if (len == 0)
+	return 0;
+    if (c->off && c->len + len > c->alloc) {
+	memmove(c->buf, c->buf + c->off, c->len - c->off);
+	c->len -= c->off, c->off = 0;
+    }
+    if (c->len + len > c->alloc) {
+	size_t alloc = c->alloc ? 2 * c->alloc : FANOUTBUF;
+	while (alloc < c->len + len)
+	    alloc *= 2;
+	char *buf = realloc(c->buf, alloc);
+	if (!buf)
+	    die("%s: %m", "realloc");
+	c->buf = buf, c->alloc = alloc;
+    }
+    memcpy(c->buf + c->len, str, len);
+    c->len += len;
+    return 0;
 }
 
-// Drain the queue and join the worker thread.
-void finish(pthread_t thread, const char *fmt)
+// Write out what is pending, close the pipes, and wait for the consumers,
+// all of them at once.  Returns false if any of them has failed.
+static bool finishFanout(bool stats)
 {
-    // Lock the mutex.
-    int err = pthread_mutex_lock(&Q.mutex);
-    if (err) die("%s: %s", "pthread_mutex_lock", xstrerror(err));
-    // Help as much as possible.
     while (1) {
-	struct qent *qe = needAid1();
-	if (qe)
-	    aid(qe, fmt);
-	else
+	bool pending = false;
+	for (unsigned i = 0; i < nconsumers; i++)
+	    if (consumers[i].off < consumers[i].len)
+		pending = true;
+	if (!pending)
 	    break;
+	waitConsumers(NULL);
     }
-    // Still need to wait if the queue is full.
-    while (Q.nq == NQ) {
-	err = pthread_cond_wait(&Q.can_produce, &Q.mutex);
-	if (err) die("%s: %s", "pthread_cond_wait", xstrerror(err));
-    }
-    // Put the sentinel.
-    Q.q[Q.nq++] = (struct qent) { { NULL }, { 0 }, STAGE_BLOB };
-    Q.nblob++;
-    // Let them know.
-    err = pthread_cond_signal(&Q.can_consume);
-    if (err) die("%s: %s", "pthread_cond_signal", xstrerror(err));
-    // Unlock the mutex.
-    err = pthread_mutex_unlock(&Q.mutex);
-    if (err) die("%s: %s", "pthread_mutex_unlock", xstrerror(err));
-    // Join the worker thread.
-    err = pthread_join(thread, NULL);
-    if (err) die("%s: %s", "pthread_join", xstrerror(err));
-    // Verify the bookkeeping.
-    assert(Q.nblob == 0), assert(Q.blobBytes == 0);
+    for (unsigned i = 0; i < nconsumers; i++)
+	close(consumers[i].fd);
+    bool ok = true;
+    for (unsigned i = 0; i < nconsumers; i++) {
+	struct consumer *c = &consumers[i];
+	int status;
+	while (waitpid(c->pid, &status, 0) < 0)
+	    if (errno != EINTR)
+		die("%s: %m", "waitpid");
+	if (WIFSIGNALED(status)) {
+	    warn("%s: consumer %u killed by signal %d", fanoutCmd, i, WTERMSIG(status));
+	    ok = false;
+	}
+	else if (WEXITSTATUS(status)) {
+	    warn("%s: consumer %u exited with status %d", fanoutCmd, i, WEXITSTATUS(status));
+	    ok = false;
+	}
+	if (stats)
+	    fprintf(stderr, "fanout: consumer %u: %lu records, %.1f MB, waited %lu times\n",
+		    i, c->records, c->bytes / 1e6, c->waits);
+	free(c->buf);
+    }
+    free(consumers);
+    return ok;
 }
 
-#include <unistd.h>
-#include <zpkglist.h>
+// With --build-order, the sources are printed along with the step,
+// the members of a cycle sharing theirs.
+static int printStep(void *arg, unsigned step, const char *const names[], unsigned n)
+{
+    (void) arg;
+    for (unsigned i = 0; i < n; i++)
+	printf("%u\t%s\n", step, names[i]);
+    if (n > 1) {
+	fprintf(stderr, "%s: cycle at step %u:", PROG, step);
+	for (unsigned i = 0; i < n; i++)
+	    fprintf(stderr, " %s", names[i]);
+	fputc('\n', stderr);
+    }
+    return 0;
+}
+
+static int buildOrder(int nthreads, char **srclists, int nsrclists, int argc, char **argv)
+{
+    const char *err[2];
+    struct pkglistDeps *d = pkglistDepsNew(nthreads, err);
+    if (!d)
+	die("%s: %s", err[0], err[1]);
+    for (int i = 0; i < nsrclists + argc; i++) {
+	const char *fname = i < nsrclists ? srclists[i] : argv[i - nsrclists];
+	int fd = 0;
+	if (strcmp(fname, "-") == 0)
+	    fname = "<stdin>";
+	else {
+	    fd = open(fname, O_RDONLY);
+	    if (fd < 0)
+		die("%s: open: %m", fname);
+	}
+	if ((i < nsrclists ? pkglistDepsAddSources(d, fd, err) :
+			     pkglistDepsAddBinaries(d, fd, err)) < 0)
+	    die("%s: %s: %s", fname, err[0], err[1]);
+    }
+    size_t unresolved;
+    if (pkglistDepsOrder(d, printStep, NULL, &unresolved, err) < 0)
+	die("%s: %s", err[0], err[1]);
+    if (unresolved)
+	warn("%zu build requirements not provided by any package", unresolved);
+    pkglistDepsFree(d);
+    return 0;
+}
+
+// With --rdeps, each package is printed along with the depth and the path,
+// e.g. "2\tfoo -> libbar -> libbaz.so.1".
+static int printPath(void *arg, unsigned depth, const char *const path[], unsigned n)
+{
+    (void) arg;
+    printf("%u\t", depth);
+    for (unsigned i = 0; i < n; i++)
+	printf(i ? " -> %s" : "%s", path[i]);
+    putchar('\n');
+    return 0;
+}
+
+static int rdeps(int nthreads, const char *what, unsigned maxDepth, int argc, char **argv)
+{
+    const char *err[2];
+    struct pkglistRdeps *r = pkglistRdepsNew(nthreads, err);
+    if (!r)
+	die("%s: %s", err[0], err[1]);
+    for (int i = 0; i < argc; i++) {
+	const char *fname = argv[i];
+	int fd = 0;
+	if (strcmp(fname, "-") == 0)
+	    fname = "<stdin>";
+	else {
+	    fd = open(fname, O_RDONLY);
+	    if (fd < 0)
+		die("%s: open: %m", fname);
+	}
+	if (pkglistRdepsAdd(r, fd, err) < 0)
+	    die("%s: %s: %s", fname, err[0], err[1]);
+    }
+    int n = pkglistRdepsWalk(r, what, maxDepth, printPath, NULL, err);
+    if (n < 0)
+	die("%s: %s", err[0], err[1]);
+    if (n == 0)
+	warn("%s: not required by any package", what);
+    pkglistRdepsFree(r);
+    return 0;
+}
+
+// With --diff, each change is printed as the sign, the package, and
+// the file; a file moved from another package gets its name appended.
+static int printChange(void *arg, int op, const char *name, const char *file, const char *from)
+{
+    (void) arg;
+    if (from)
+	printf("%c\t%s\t%s\t%s\n", op, name, file, from);
+    else
+	printf("%c\t%s\t%s\n", op, name, file);
+    return 0;
+}
 
-void processFd(int fd, const char *fname, const char *fmt)
+static int diff(int nthreads, char **olds, int nolds, int argc, char **argv)
 {
     const char *err[2];
-    struct zpkglistReader *z;
-    const char *func = "zpkglistFdopen";
-    ssize_t ret = zpkglistFdopen(&z, fd, err);
-    if (ret > 0) {
-	void *blob;
-	func = "zpkglistNextMalloc";
-	while ((ret = zpkglistNextMalloc(z, &blob, NULL, false, err)) > 0)
-	    processBlob(blob, ret, fmt);
-	zpkglistFree(z);
-    }
-    close(fd);
-    if (ret < 0) {
-	if (strcmp(func, err[0]) == 0 || strncmp(err[0], "zpkglist", 8) == 0)
+    struct pkglistDiff *d = pkglistDiffNew(nthreads, err);
+    if (!d)
+	die("%s: %s", err[0], err[1]);
+    for (int i = 0; i < nolds + argc; i++) {
+	const char *fname = i < nolds ? olds[i] : argv[i - nolds];
+	int fd = 0;
+	if (strcmp(fname, "-") == 0)
+	    fname = "<stdin>";
+	else {
+	    fd = open(fname, O_RDONLY);
+	    if (fd < 0)
+		die("%s: open: %m", fname);
+	}
+	if ((i < nolds ? pkglistDiffAddOld(d, fd, err) :
+			 pkglistDiffAddNew(d, fd, err)) < 0)
 	    die("%s: %s: %s", fname, err[0], err[1]);
-	else
-	    die("%s: %s: %s: %s", fname, func, err[0], err[1]);
     }
+    if (pkglistDiffFinish(d, printChange, NULL, err) < 0)
+	die("%s: %s", err[0], err[1]);
+    pkglistDiffFree(d);
+    return 0;
+}
+
+// With --shell, the pkglists are loaded into memory once, and then the
+// commands are read from stdin, line by line, each query being run over
+// the loaded headers on all the threads.  Ctrl-C stops the query, through
+// the callback, and leaves the headers loaded.
+static volatile sig_atomic_t interrupted;
+
+static void onInterrupt(int sig)
+{
+    (void) sig;
+    interrupted = 1;
+}
+
+// While a query runs, the writes are restarted, so that it is only
+// the callback which sees the signal.  At the prompt, the read is not,
+// and the line is dropped.
+static void catchInterrupt(bool restart)
+{
+    struct sigaction sa = { .sa_handler = onInterrupt };
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = restart ? SA_RESTART : 0;
+    sigaction(SIGINT, &sa, NULL);
+}
+
+static int shellPrint(void *arg, const char *str, size_t len)
+{
+    size_t *nresults = arg;
+    if (interrupted)
+	return 1;
+    if (len) {
+	(*nresults)++;
+	print(NULL, str, len);
+    }
+    return 0;
+}
+
+// Run the format over the headers given by their ordinals, or over all of them.
+static void shellQuery(struct pkglistRepo *r, int nthreads, const char *fmt,
+	char **where, int nwhere, const size_t *idx, size_t n, bool tty)
+{
+    const char *err[2];
+    size_t nresults = 0;
+    struct pkglistQuery *q = pkglistQueryNew(fmt, nthreads, shellPrint, &nresults, err);
+    if (!q) {
+	warn("%s: %s", err[0], err[1]);
+	return;
+    }
+    for (int i = 0; i < nwhere; i++)
+	if (pkglistQueryWhere(q, where[i], err) < 0)
+	    die("%s: %s: %s", where[i], err[0], err[1]);
+    uint64_t t0 = clockNs();
+    interrupted = 0;
+    catchInterrupt(true);
+    watchProgress(q);
+    ssize_t nfed = pkglistQueryRepo(q, r, idx, n, err);
+    // After a failure, the query is still finished, keeping the first error.
+    const char *ferr[2];
+    int rc = pkglistQueryFinish(q, nfed < 0 ? ferr : err);
+    catchInterrupt(false);
+    stopProgress();
+    pkglistQueryFree(q);
+    if (fflush_unlocked(stdout) == EOF)
+	die("%s: %m", "fflush");
+    if (interrupted)
+	warn("interrupted");
+    else if (nfed < 0 || rc < 0)
+	warn("%s: %s", err[0], err[1]);
+    else if (tty)
+	fprintf(stderr, "%zu of %zd headers, %.3f s\n", nresults, nfed, (clockNs() - t0) / 1e9);
+}
+
+static const char shellHelp[] =
+    "FMT            run the format over the headers, with the conditions;\n"
+    "               a format without \\n gets one at the end\n"
+    "where TAG=GLOB add a condition, or list them\n"
+    "clear          drop the conditions\n"
+    "lookup NAME    run the last format over the packages of the name\n"
+    "help           this text\n"
+    "quit           or EOF\n";
+
+static int shell(int nthreads, int argc, char **argv)
+{
+    const char *err[2];
+    struct pkglistRepo *r = pkglistRepoNew(err);
+    if (!r)
+	die("%s: %s", err[0], err[1]);
+    bool tty = isatty(0);
+    uint64_t t0 = clockNs();
+    for (int i = 0; i < argc; i++) {
+	if (strcmp(argv[i], "-") == 0)
+	    die("cannot load <stdin>, which is for the commands");
+	int fd = open(argv[i], O_RDONLY);
+	if (fd < 0)
+	    die("%s: open: %m", argv[i]);
+	if (pkglistRepoAdd(r, fd, err) < 0)
+	    die("%s: %s: %s", argv[i], err[0], err[1]);
+    }
+    size_t bytes;
+    size_t n = pkglistRepoCount(r, &bytes);
+    if (tty)
+	fprintf(stderr, "%zu headers, %.1f MB, loaded in %.3f s; type help for the commands\n",
+		n, bytes / 1e6, (clockNs() - t0) / 1e9);
+    char *fmt = strdup("%{NAME}-%{VERSION}-%{RELEASE}.%{ARCH}\\n");
+    char *where[256];
+    int nwhere = 0;
+    if (!fmt)
+	die("%s: %m", "strdup");
+    catchInterrupt(false);
+    char *line = NULL;
+    size_t alloc = 0;
+    while (1) {
+	if (tty)
+	    fputs("> ", stderr);
+	ssize_t len = getline(&line, &alloc, stdin);
+	if (len < 0 && errno == EINTR && interrupted) {
+	    clearerr(stdin);
+	    interrupted = 0;
+	    fputc('\n', stderr);
+	    continue;
+	}
+	if (len < 0)
+	    break;
+	if (len && line[len-1] == '\n')
+	    line[--len] = '\0';
+	char *cmd = line + strspn(line, " \t");
+	size_t cmdLen = strcspn(cmd, " \t");
+	char *arg = cmd + cmdLen + strspn(cmd + cmdLen, " \t");
+#define IS(word) (cmdLen == strlen(word) && strncmp(cmd, word, cmdLen) == 0)
+	if (*cmd == '\0')
+	    continue;
+	if (IS("quit") || IS("exit"))
+	    break;
+	if (IS("help"))
+	    fputs(shellHelp, stderr);
+	else if (IS("where") && !*arg)
+	    for (int i = 0; i < nwhere; i++)
+		fprintf(stderr, "where %s\n", where[i]);
+	else if (IS("where")) {
+	    // Checked right away, on a query which is never started,
+	    // and so never starts the threads.
+	    struct pkglistQuery *q = pkglistQueryNew(fmt, 1, print, NULL, err);
+	    if (!q)
+		die("%s: %s", err[0], err[1]);
+	    if (nwhere == sizeof where / sizeof *where)
+		warn("too many conditions");
+	    else if (pkglistQueryWhere(q, arg, err) < 0)
+		warn("%s: %s: %s", arg, err[0], err[1]);
+	    else if (!(where[nwhere++] = strdup(arg)))
+		die("%s: %m", "strdup");
+	    pkglistQueryFree(q);
+	}
+	else if (IS("clear")) {
+	    while (nwhere)
+		free(where[--nwhere]);
+	}
+	else if (IS("lookup") && !*arg)
+	    warn("lookup needs a name");
+	else if (IS("lookup")) {
+	    const size_t *idx;
+	    ssize_t nidx = pkglistRepoLookup(r, arg, &idx, err);
+	    if (nidx < 0)
+		die("%s: %s", err[0], err[1]);
+	    if (nidx == 0)
+		warn("%s: no such package", arg);
+	    else
+		shellQuery(r, nthreads, fmt, where, nwhere, idx, nidx, tty);
+	}
+	else {
+	    char *newFmt = malloc(strlen(cmd) + 3);
+	    if (!newFmt)
+		die("%s: %m", "malloc");
+	    strcpy(newFmt, cmd);
+	    if (!strstr(newFmt, "\\n"))
+		strcat(newFmt, "\\n");
+	    // A bad format is reported, and the last one is kept.
+	    struct pkglistQuery *q = pkglistQueryNew(newFmt, 1, print, NULL, err);
+	    if (!q) {
+		warn("%s: %s", err[0], err[1]);
+		free(newFmt);
+		continue;
+	    }
+	    pkglistQueryFree(q);
+	    free(fmt);
+	    fmt = newFmt;
+	    shellQuery(r, nthreads, fmt, where, nwhere, NULL, 0, tty);
+	}
+#undef IS
+    }
+    if (tty)
+	fputc('\n', stderr);
+    free(line);
+    free(fmt);
+    while (nwhere)
+	free(where[--nwhere]);
+    pkglistRepoFree(r);
+    return 0;
+}
+
+#include <sys/stat.h>
+
+// With --explain, the inputs are listed with their sizes, which is
+// what the work scales with.
+static void explainInputs(const char *what, int argc, char **argv)
+{
+    double total = 0;
+    for (int i = 0; i < argc; i++) {
+	struct stat st;
+	if (strcmp(argv[i], "-") == 0)
+	    printf("%s: <stdin>, size unknown\n", what);
+	else if (stat(argv[i], &st))
+	    die("%s: %m", argv[i]);
+	else {
+	    printf("%s: %s, %.1f MB\n", what, argv[i], st.st_size / 1e6);
+	    total += st.st_size;
+	}
+    }
+    printf("%s: %d file%s, %.1f MB in all\n", what, argc, argc == 1 ? "" : "s", total / 1e6);
 }
 
 #include <getopt.h>
-#include <fcntl.h> // O_RDONLY
+
+enum {
+    OPT_TRACE = 256,
+    OPT_STATS,
+    OPT_PROCS,
+    OPT_WHERE,
+    OPT_REWRITE,
+    OPT_STRIP,
+    OPT_VERIFY,
+    OPT_MERGE,
+    OPT_DEDUP,
+    OPT_TOP,
+    OPT_BY,
+    OPT_BUILD_ORDER,
+    OPT_RDEPS,
+    OPT_DEPTH,
+    OPT_DIFF,
+    OPT_EXPLAIN,
+    OPT_METRICS_FILE,
+    OPT_METRICS_INTERVAL,
+    OPT_HUGE_PAGES,
+    OPT_FANOUT,
+    OPT_FANOUT_KEY,
+    OPT_SHELL,
+};
 
 const struct option longopts[] = {
+    { "jobs", required_argument, NULL, 'j' },
+    { "output", required_argument, NULL, 'o' },
+    { "trace", required_argument, NULL, OPT_TRACE },
+    { "stats", no_argument, NULL, OPT_STATS },
+    { "procs", no_argument, NULL, OPT_PROCS },
+    { "where", required_argument, NULL, OPT_WHERE },
+    { "rewrite", required_argument, NULL, OPT_REWRITE },
+    { "strip", required_argument, NULL, OPT_STRIP },
+    { "verify", no_argument, NULL, OPT_VERIFY },
+    { "merge", required_argument, NULL, OPT_MERGE },
+    { "dedup", optional_argument, NULL, OPT_DEDUP },
+    { "top", required_argument, NULL, OPT_TOP },
+    { "by", required_argument, NULL, OPT_BY },
+    { "build-order", required_argument, NULL, OPT_BUILD_ORDER },
+    { "rdeps", required_argument, NULL, OPT_RDEPS },
+    { "depth", required_argument, NULL, OPT_DEPTH },
+    { "diff", required_argument, NULL, OPT_DIFF },
+    { "explain", no_argument, NULL, OPT_EXPLAIN },
+    { "metrics-file", required_argument, NULL, OPT_METRICS_FILE },
+    { "metrics-interval", required_argument, NULL, OPT_METRICS_INTERVAL },
+    { "huge-pages", no_argument, NULL, OPT_HUGE_PAGES },
+    { "fanout", required_argument, NULL, OPT_FANOUT },
+    { "fanout-key", no_argument, NULL, OPT_FANOUT_KEY },
+    { "shell", no_argument, NULL, OPT_SHELL },
     { "help", no_argument, NULL, 'h' },
     { NULL },
 };
@@ -378,30 +900,435 @@ const struct option longopts[] = {
 int main(int argc, char **argv)
 {
     bool usage = false;
+    int nthreads = 0; // unless -j is given, see below
+    FILE *traceFile = NULL;
+    bool stats = false;
+    bool procs = false;
+    const char *where[argc];
+    int nwhere = 0;
+    const char *rewrite = NULL;
+    char *strip[argc];
+    int nstrip = 0;
+    bool verify = false;
+    int mergeKey = -1;
+    size_t dedup = 0;
+    unsigned top = 0;
+    const char *by = NULL;
+    char *srclists[argc];
+    int nsrclists = 0;
+    const char *rdepsOf = NULL;
+    unsigned depth = 0;
+    char *olds[argc];
+    int nolds = 0;
+    bool explain = false;
+    bool huge = false;
+    bool shellMode = false;
+    const char *output = NULL;
+    unsigned nfanout = 0;
+    // The command for --fanout follows "--", which also ends the options.
+    char **cmd = NULL;
+    int ncmd = 0;
+    for (int i = 1; i < argc; i++)
+	if (strcmp(argv[i], "--") == 0) {
+	    cmd = argv + i + 1, ncmd = argc - i - 1;
+	    argv[i] = NULL, argc = i;
+	    break;
+	}
     int c;
-    while ((c = getopt_long(argc, argv, "h", longopts, NULL)) != -1)
+    while ((c = getopt_long(argc, argv, "j:o:h", longopts, NULL)) != -1) {
+	switch (c) {
+	case 'j':
+	    nthreads = atoi(optarg);
+	    if (nthreads < 1)
+		die("invalid number of jobs: %s", optarg);
+	    break;
+	case OPT_TRACE:
+	    traceFile = fopen(optarg, "w");
+	    if (!traceFile)
+		die("%s: %m", optarg);
+	    break;
+	case OPT_STATS:
+	    stats = true;
+	    break;
+	case OPT_PROCS:
+	    procs = true;
+	    break;
+	case OPT_WHERE:
+	    where[nwhere++] = optarg;
+	    break;
+	case OPT_REWRITE:
+	    rewrite = optarg;
+	    break;
+	case OPT_STRIP:
+	    strip[nstrip++] = optarg;
+	    break;
+	case OPT_VERIFY:
+	    verify = true;
+	    break;
+	case OPT_MERGE:
+	    if (strcmp(optarg, "name") == 0)
+		mergeKey = PKGLIST_MERGE_NAME;
+	    else if (strcmp(optarg, "nevra") == 0)
+		mergeKey = PKGLIST_MERGE_NEVRA;
+	    else
+		die("invalid merge key: %s", optarg);
+	    break;
+	case OPT_DEDUP:
+	    // The output cache budget, in megabytes.
+	    dedup = 256;
+	    if (optarg) {
+		char *end;
+		unsigned long mb = strtoul(optarg, &end, 10);
+		if (end == optarg || *end || mb < 1)
+		    die("invalid dedup budget: %s", optarg);
+		dedup = mb;
+	    }
+	    break;
+	case OPT_TOP: {
+	    char *end;
+	    unsigned long k = strtoul(optarg, &end, 10);
+	    if (end == optarg || *end || k < 1 || k > 1 << 24)
+		die("invalid number of headers: %s", optarg);
+	    top = k;
+	    break; }
+	case OPT_BY:
+	    by = optarg;
+	    break;
+	case OPT_BUILD_ORDER:
+	    srclists[nsrclists++] = optarg;
+	    break;
+	case OPT_RDEPS:
+	    rdepsOf = optarg;
+	    break;
+	case OPT_DIFF:
+	    olds[nolds++] = optarg;
+	    break;
+	case OPT_EXPLAIN:
+	    explain = true;
+	    break;
+	case 'o':
+	    output = optarg;
+	    break;
+	case OPT_HUGE_PAGES:
+	    huge = true;
+	    break;
+	case OPT_FANOUT: {
+	    char *end;
+	    unsigned long n = strtoul(optarg, &end, 10);
+	    if (end == optarg || *end || n < 1 || n > 1024)
+		die("invalid number of consumers: %s", optarg);
+	    nfanout = n;
+	    break; }
+	case OPT_FANOUT_KEY:
+	    fanoutKey = true;
+	    break;
+	case OPT_SHELL:
+	    shellMode = true;
+	    break;
+	case OPT_METRICS_FILE:
+	    metricsFile = optarg;
+	    break;
+	case OPT_METRICS_INTERVAL: {
+	    char *end;
+	    unsigned long sec = strtoul(optarg, &end, 10);
+	    if (end == optarg || *end || sec < 1 || sec > 1 << 24)
+		die("invalid metrics interval: %s", optarg);
+	    metricsInterval = sec;
+	    break; }
+	case OPT_DEPTH: {
+	    char *end;
+	    unsigned long n = strtoul(optarg, &end, 10);
+	    if (end == optarg || *end || n < 1 || n > 1 << 24)
+		die("invalid depth: %s", optarg);
+	    depth = n;
+	    break; }
+	default:
+	    usage = true;
+	}
+    }
+    if (procs && (traceFile || stats)) {
+	warn("--procs cannot be combined with --trace or --stats");
+	usage = true;
+    }
+    if (dedup && traceFile) {
+	warn("--dedup cannot be combined with --trace");
+	usage = true;
+    }
+    if (!top != !by) {
+	warn("--top and --by go together");
+	usage = true;
+    }
+    if (top && (procs || dedup || rewrite || verify)) {
+	warn("--top cannot be combined with --procs, --dedup, --rewrite, or --verify");
+	usage = true;
+    }
+    if ((nsrclists || rdepsOf || nolds) && (procs || nwhere || rewrite || verify ||
+					    mergeKey >= 0 || dedup || top || traceFile || stats)) {
+	warn("--build-order, --rdeps, and --diff only go with -j");
+	usage = true;
+    }
+    if (!!nsrclists + !!rdepsOf + !!nolds > 1) {
+	warn("--build-order, --rdeps, and --diff cannot be combined");
+	usage = true;
+    }
+    if (depth && !rdepsOf) {
+	warn("--depth only works with --rdeps");
+	usage = true;
+    }
+    if (verify && (rewrite || nwhere)) {
+	warn("--verify cannot be combined with --rewrite or --where");
+	usage = true;
+    }
+    if (nstrip && !rewrite) {
+	warn("--strip only works with --rewrite");
+	usage = true;
+    }
+    if (output && (rewrite || verify || nsrclists || rdepsOf || nolds)) {
+	warn("-o only works with a format query");
 	usage = true;
+    }
+    // Without --fanout, the arguments after "--" are just arguments.
+    if (cmd && !nfanout) {
+	memmove(argv + argc, cmd, (ncmd + 1) * sizeof *cmd);
+	argc += ncmd, cmd = NULL;
+    }
+    if (nfanout && !ncmd) {
+	warn("--fanout needs a command after --");
+	usage = true;
+    }
+    if (nfanout && (output || rewrite || verify || nsrclists || rdepsOf || nolds)) {
+	warn("--fanout only works with a format query, and not with -o");
+	usage = true;
+    }
+    if (shellMode && (procs || nwhere || rewrite || verify || mergeKey >= 0 || dedup ||
+		      top || traceFile || stats || nsrclists || rdepsOf || nolds ||
+		      output || nfanout || metricsFile || huge)) {
+	warn("--shell only goes with -j");
+	usage = true;
+    }
+    if (fanoutKey && !nfanout) {
+	warn("--fanout-key only works with --fanout");
+	usage = true;
+    }
+    // The shell is there to run the queries fast, on all the cores.
+    if (nthreads == 0) {
+	nthreads = shellMode ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+	if (nthreads < 1)
+	    nthreads = 1;
+	if (nthreads > PKGLISTQUERY_MAXTHREADS)
+	    nthreads = PKGLISTQUERY_MAXTHREADS;
+    }
+    if (metricsInterval && !metricsFile) {
+	warn("--metrics-interval only works with --metrics-file");
+	usage = true;
+    }
     if (usage) {
-usage:	fprintf(stderr, "Usage: " PROG " FMT [PKGLIST...]\n");
+usage:	fprintf(stderr, "Usage: " PROG " [-j JOBS] [-o FILE] [--procs] [--where=TAG=GLOB]... "
+		"[--merge=name|nevra] [--dedup[=MB]] [--top=K --by=[#]TAG] "
+		"[--trace=FILE] [--stats] [--explain] FMT [PKGLIST...]\n"
+		"       " PROG " [--metrics-file=FILE [--metrics-interval=SEC]] [--huge-pages] ...\n"
+		"       " PROG " [OPTION]... --fanout=N [--fanout-key] FMT [PKGLIST...] -- CMD [ARG]...\n"
+		"       " PROG " [-j JOBS] [--procs] [--where=TAG=GLOB]... "
+		"--rewrite=OUT [--strip=TAG,...]... [PKGLIST...]\n"
+		"       " PROG " [-j JOBS] [--procs] --verify [PKGLIST...]\n"
+		"       " PROG " [-j JOBS] --build-order=SRCLIST... [PKGLIST...]\n"
+		"       " PROG " [-j JOBS] --rdeps=CAP|PKG [--depth=N] [PKGLIST...]\n"
+		"       " PROG " [-j JOBS] --diff=OLD... [PKGLIST...]\n"
+		"       " PROG " [-j JOBS] --shell PKGLIST...\n"
+		"With --merge=name|nevra, the pkglists go in the order of priority.\n"
+		"With --dedup, identical headers are only formatted once.\n"
+		"With --top=K, only the K headers with the largest TAG value, or with\n"
+		"the most #TAG values, are formatted, best first.\n"
+		"With --build-order, the sources from the srclists are printed in the order\n"
+		"to build them, with the build requirements resolved against the pkglists.\n"
+		"With --rdeps, the packages which require CAP, or anything PKG provides,\n"
+		"are printed with the depth and the path, up to N requirements deep.\n"
+		"With --diff, the files added (+), removed (-), and moved from another\n"
+		"package (m) are printed, package by package, from OLD to PKGLIST.\n"
+		"With --explain, the plan is printed instead of running the query.\n"
+		"With --metrics-file, the metrics are written in the Prometheus text format\n"
+		"at the exit, and every SEC seconds while the query runs.\n"
+		"With -o, the output is written to the file by all the threads at once.\n"
+		"With --fanout, the output of each header goes to one of N copies of CMD,\n"
+		"in turn, or with --fanout-key, by the hash of its first field.\n"
+		"With --shell, the pkglists are loaded into memory, and the queries are\n"
+		"read from stdin, line by line, and run on all the cores unless -j is given;\n"
+		"Ctrl-C stops a query.\n"
+		"With --huge-pages, the output buffer and the rings of the worker processes\n"
+		"are backed by huge pages, if the system allows.\n"
+		"On SIGUSR1, the progress of a query is printed to stderr.\n");
 	return 1;
     }
     argc -= optind, argv += optind;
-    if (argc < 1) {
-	warn("not enough arguments");
+    const char *fmt = NULL;
+    if (!rewrite && !verify && !nsrclists && !rdepsOf && !nolds && !shellMode) {
+	if (argc < 1) {
+	    warn("not enough arguments");
+	    goto usage;
+	}
+	fmt = argv[0];
+	argc--, argv++;
+    }
+    if (argc < 1 && shellMode) {
+	warn("--shell needs the pkglists, stdin is for the commands");
 	goto usage;
     }
-    const char *fmt = argv[0];
-    argc--, argv++;
-    if (argc < 1 && isatty(0)) {
+    if (argc < 1 && isatty(0) && !explain) {
 	warn("refusing to read binary data from a terminal");
 	goto usage;
     }
     char *assume_argv[] = { "-", NULL };
     if (argc < 1)
 	argc = 1, argv = assume_argv;
-    pthread_t thread;
-    int err = pthread_create(&thread, NULL, worker, (void *) fmt);
-    if (err) die("%s: %s", "pthread_create", xstrerror(err));
+    if (metricsFile && !explain) {
+	startNs = clockNs();
+	on_exit(exitMetrics, NULL);
+    }
+    // A big output buffer also means fewer write calls, but a terminal
+    // is better left line-buffered.
+    size_t hugeBufSize = HUGEBUF;
+    const char *hugeBufHow = NULL;
+    if (huge && !explain && !isatty(1)) {
+	char *buf = pkglistHugeMap(&hugeBufSize, false, &hugeBufHow);
+	if (!buf)
+	    die("%s: %m", "mmap");
+	setvbuf(stdout, buf, _IOFBF, hugeBufSize);
+    }
+    if (explain && (nsrclists || rdepsOf || nolds || shellMode)) {
+	if (shellMode)
+	    printf("shell: the blobs are read and decompressed once, into memory; "
+		    "each query copies them, and formats them on %d thread%s, as with a pkglist; "
+		    "lookup goes through the index by the name, sorted on the first use\n",
+		    nthreads, nthreads > 1 ? "s" : "");
+	else if (nsrclists) {
+	    printf("build order: on %d thread%s, the sources' build requirements are read "
+		    "from the blobs and interned; the binaries' names, provides, and files "
+		    "are looked up in the table, yielding the ids\n", nthreads, nthreads > 1 ? "s" : "");
+	    printf("graph: the providers and the edges in CSR arrays, "
+		    "Tarjan's components, the dependencies first\n");
+	    explainInputs("srclist", nsrclists, srclists);
+	}
+	else if (rdepsOf) {
+	    printf("rdeps: on %d thread%s, the names, provides, files, and requirements "
+		    "are hashed from the blobs\n", nthreads, nthreads > 1 ? "s" : "");
+	    printf("graph: the requirers of each package in a CSR array, "
+		    "a breadth-first walk from %s", rdepsOf);
+	    if (depth)
+		printf(", %u deep", depth);
+	    putchar('\n');
+	}
+	else {
+	    printf("diff: on %d thread%s, the old file lists are sorted; the new headers "
+		    "are paired by the name, the same ones are skipped by SHA1HEADER "
+		    "or the blob hash, the others are merged; the moves are matched "
+		    "at the end\n", nthreads, nthreads > 1 ? "s" : "");
+	    explainInputs("old", nolds, olds);
+	}
+	explainInputs("input", argc, argv);
+	return 0;
+    }
+    if (!explain)
+	startProgress();
+    if (shellMode)
+	return shell(nthreads, argc, argv);
+    if (nsrclists)
+	return buildOrder(nthreads, srclists, nsrclists, argc, argv);
+    if (rdepsOf)
+	return rdeps(nthreads, rdepsOf, depth, argc, argv);
+    if (nolds)
+	return diff(nthreads, olds, nolds, argc, argv);
+    const char *err[2];
+    // The first pass of the merge, each file is then read again.
+    struct pkglistMerge *m = NULL;
+    if (mergeKey >= 0) {
+	m = pkglistMergeNew(mergeKey, err);
+	if (!m)
+	    die("%s: %s", err[0], err[1]);
+	uint64_t t0 = clockNs();
+	for (int i = 0; i < argc && !explain; i++) {
+	    if (strcmp(argv[i], "-") == 0)
+		die("cannot merge <stdin>, which needs to be read twice");
+	    int fd = open(argv[i], O_RDONLY);
+	    if (fd < 0)
+		die("%s: open: %m", argv[i]);
+	    if (pkglistMergeScan(m, fd, err) < 0)
+		die("%s: %s: %s", argv[i], err[0], err[1]);
+	}
+	stageDone(STAGE_MERGE, t0);
+    }
+    if (nfanout && !explain)
+	startFanout(nfanout, cmd);
+    struct compressor z;
+    struct pkglistQuery *q;
+    if (rewrite && explain)
+	q = pkglistQueryNewRaw(nthreads, writeBlob, &z, err);
+    else if (rewrite) {
+	z.out = open(rewrite, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (z.out < 0)
+	    die("%s: %m", rewrite);
+	if (pipe(z.pipe))
+	    die("%s: %m", "pipe");
+	signal(SIGPIPE, SIG_IGN);
+	int rc = pthread_create(&z.thread, NULL, compressor, &z);
+	if (rc)
+	    die("%s: %s", "pthread_create", strerror(rc));
+	q = pkglistQueryNewRaw(nthreads, writeBlob, &z, err);
+    }
+    else if (verify)
+	q = pkglistQueryNewVerify(nthreads, report, NULL, err);
+    else
+	q = pkglistQueryNew(fmt, nthreads, nfanout ? fanout : print, NULL, err);
+    if (!q)
+	die("%s: %s", err[0], err[1]);
+    for (int i = 0; i < nstrip; i++)
+	for (char *tag = strtok(strip[i], ","); tag; tag = strtok(NULL, ","))
+	    if (pkglistQueryStrip(q, tag, err) < 0)
+		die("%s: %s: %s", tag, err[0], err[1]);
+    for (int i = 0; i < nwhere; i++)
+	if (pkglistQueryWhere(q, where[i], err) < 0)
+	    die("%s: %s: %s", where[i], err[0], err[1]);
+    if (procs)
+	pkglistQueryUseProcesses(q);
+    if (procs && huge)
+	pkglistQueryUseHugePages(q);
+    int outFd = -1;
+    if (output && !explain) {
+	outFd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (outFd < 0)
+	    die("%s: %m", output);
+	if (pkglistQueryOutputFd(q, outFd, err) < 0)
+	    die("%s: %s: %s", output, err[0], err[1]);
+    }
+    if (traceFile)
+	pkglistQueryTrace(q, traceFile);
+    if (stats)
+	pkglistQueryEnableStats(q);
+    if (top && pkglistQueryTop(q, top, by, err) < 0)
+	die("%s: %s: %s", by, err[0], err[1]);
+    if (dedup && pkglistQueryDedup(q, dedup << 20, err) < 0)
+	die("%s: %s", err[0], err[1]);
+    if (explain) {
+	pkglistQueryExplain(q, stdout);
+	if (m)
+	    printf("merge: a first pass over the pkglists, the %s keys read from the blobs, "
+		    "then only the winners are fed\n", mergeKey == PKGLIST_MERGE_NAME ? "name" : "nevra");
+	if (rewrite)
+	    printf("rewrite: to %s, compressed on its own thread\n", rewrite);
+	if (output)
+	    printf("output: to %s, each result at the sum of the sizes before it, "
+		    "written with pwrite by the thread which finished it\n", output);
+	if (nfanout)
+	    printf("fanout: to %u cop%s of %s, %s, through non-blocking pipes "
+		    "with up to %d MB pending each\n", nfanout, nfanout > 1 ? "ies" : "y", cmd[0],
+		    fanoutKey ? "by the hash of the first field" : "in turn", FANOUTBUF >> 20);
+	explainInputs("input", argc, argv);
+	pkglistQueryFree(q);
+	pkglistMergeFree(m);
+	return 0;
+    }
+    watchProgress(q);
+    uint64_t t0 = clockNs();
+    const char *failed = NULL;
     for (int i = 0; i < argc; i++) {
 	int fd = 0;
 	const char *fname = argv[i];
@@ -412,12 +1339,59 @@ usage:	fprintf(stderr, "Usage: " PROG " FMT [PKGLIST...]\n");
 	    if (fd < 0)
 		die("%s: open: %m", fname);
 	}
-	processFd(fd, fname, fmt);
+	if ((m ? pkglistQueryFdMerged(q, fd, m, i, err) : pkglistQueryFd(q, fd, err)) < 0) {
+	    if (!rewrite)
+		die("%s: %s: %s", fname, err[0], err[1]);
+	    // The compressor's error, if any, takes precedence.
+	    failed = fname;
+	    break;
+	}
     }
-    finish(thread, fmt);
+    stageDone(STAGE_FEED, t0);
+    t0 = clockNs();
+    // After a failure, the query is still finished, keeping the first error.
+    const char *ferr[2];
+    if (pkglistQueryFinish(q, failed ? ferr : err) < 0 && !failed)
+	failed = "";
+    if (rewrite) {
+	close(z.pipe[1]);
+	pthread_join(z.thread, NULL);
+	if (z.rc < 0)
+	    die("%s: %s: %s", rewrite, z.err[0], z.err[1]);
+	if (!failed && close(z.out))
+	    die("%s: %m", rewrite);
+    }
+    bool fanoutOk = true;
+    if (nfanout && !failed)
+	fanoutOk = finishFanout(stats);
+    stageDone(STAGE_FINISH, t0);
+    if (failed && *failed)
+	die("%s: %s: %s", failed, err[0], err[1]);
+    if (failed)
+	die("%s: %s", err[0], err[1]);
+    if (outFd >= 0) {
+	off_t size = lseek(outFd, 0, SEEK_CUR);
+	if (size > 0)
+	    __atomic_store_n(&outputBytes, size, __ATOMIC_RELAXED);
+	if (close(outFd))
+	    die("%s: %m", output);
+    }
+    if (stats || dedup)
+	pkglistQueryPrintStats(q, stderr);
+    if (stats && hugeBufHow)
+	fprintf(stderr, "stdout: %zu MB buffer, %s pages\n", hugeBufSize >> 20, hugeBufHow);
+    stopProgress();
+    pkglistQueryFree(q);
+    pkglistMergeFree(m);
     if (fflush_unlocked(stdout) == EOF)
 	die("%s: %m", "fflush");
-    return 0;
+    if (traceFile && fclose(traceFile))
+	die("%s: %m", "fclose");
+    if (verify) {
+	fprintf(stderr, "%s: %lu headers verified, %lu bad\n", PROG, nverified, nbad);
+	return nbad ? 1 : 0;
+    }
+    return fanoutOk ? 0 : 1;
 }
 
 // ex:set ts=8 sts=4 sw=4 noet:
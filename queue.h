@@ -0,0 +1,517 @@
+// Copyright (c) 2017 Alexey Tourbin
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// The job queue which runs the blobs through the worker threads and puts
+// the resulting strings back in the original order.  The job itself is
+// opaque to the queue, which makes it possible to exercise the queue with
+// synthetic jobs, see qbench.c.  The includer must define PROG.
+// A process can run a few queues at a time, e.g. one per library handle.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <assert.h>
+#include <time.h>
+#include <pthread.h>
+#include "xstrerror.h"
+
+#define warn(fmt, args...) fprintf(stderr, "%s: " fmt "\n", PROG, ##args)
+#define die(fmt, args...) warn(fmt, ##args), exit(128) // like git
+
+// A job queue entry which needs to be processed: the header blob has to be
+// loaded, queried, and the formatted output string put back to str, with
+// the stage updated accordingly.  The strings then will be picked up and
+// printed in the original order.
+struct qent {
+    union { void *blob; uintptr_t cookie; char *str; };
+    union { unsigned blobSize; unsigned len; };
+    enum { STAGE_BLOB, STAGE_COOKING, STAGE_STR } stage;
+};
+
+// The maximum number of entries in the job queue.
+// Good parallelism can be achieved only with a somewhat big queue:
+// - src.rpm headers can be as small as 1K, while zstd decompression
+//   operates in 128K chunks; see also MINBYTES below;
+// - on the other hand, a big header (e.g. with many %{Filenames}) can
+//   take a lot of time to headerFormat, and if the second thread fills
+//   the remaining slots quickly, the only alternative for it is to stall.
+// Can be overridden at compile time, for benchmarking.
+#ifndef NQ
+#define NQ 128
+#endif
+
+// The maximum number of worker threads.
+#define MAXTHREADS 64
+
+// The job turns the blob into a malloc'd string; the blob is owned
+// by the job from then on.  On error, the job returns NULL and fills err.
+typedef char *(*jobFunc)(void *blob, unsigned blobSize, void *arg,
+			 size_t *lenp, const char *err[2]);
+
+// The sink gets the strings in the original order, under the lock,
+// and takes ownership of them.  A non-zero return stops the queue.
+typedef int (*sinkFunc)(void *arg, char *str, size_t len);
+
+// Optionally, the drain is called by each thread with the sink's argument
+// right after it releases the lock, having possibly run the sink, so that
+// the sink can leave the slow part of its work, such as I/O, to it.
+typedef void (*drainFunc)(void *arg);
+
+// What a worker is up to, for a progress report from another thread.
+// Each entry has a single writer, which updates it with relaxed stores,
+// so that neither side takes the lock for it.
+struct qprog {
+    uint64_t jobs, bytes;
+    bool busy;
+};
+
+// The job queue.
+struct queue {
+    pthread_mutex_t mutex;
+    pthread_cond_t can_produce;
+    pthread_cond_t can_consume;
+    // An ever increasing sequence number used as a cookie.
+    uintptr_t seq;
+    // The sum of the blob sizes of STAGE_BLOB entries.
+    size_t blobBytes;
+    // The total number of STAGE_BLOB entries in the queue.
+    int nblob;
+    int nq;
+    // The number of workers waiting for a blob.
+    int nidle;
+    int nthreads;
+    pthread_t thread[MAXTHREADS];
+    jobFunc job;
+    void *jobArg;
+    sinkFunc sink;
+    void *sinkArg;
+    drainFunc drain;
+    // The workers take a progress entry each, the last one is for the
+    // main thread's aid.
+    int nprog;
+    struct qprog prog[MAXTHREADS+1];
+    // The waits on the condition variables: the producer's for the queue
+    // to be flushed, and the workers' for a blob.  Updated under the lock
+    // with relaxed stores, for a report from another thread.
+    uint64_t produceWaits, produceWaitNs;
+    uint64_t consumeWaits, consumeWaitNs;
+    // Once the queue is stopped, by an error or by the sink, the strings
+    // are no longer passed to the sink, and the producer should give up.
+    bool stopped;
+    const char *err[2];
+    struct qent q[NQ];
+};
+
+static inline void progBegin(struct qprog *p)
+{
+    __atomic_store_n(&p->busy, true, __ATOMIC_RELAXED);
+}
+
+static inline void progEnd(struct qprog *p, unsigned blobSize)
+{
+    __atomic_store_n(&p->jobs, p->jobs + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&p->bytes, p->bytes + blobSize, __ATOMIC_RELAXED);
+    __atomic_store_n(&p->busy, false, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t qclock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Account for a wait which started at t0, under the lock.
+static inline void waited(uint64_t *waits, uint64_t *waitNs, uint64_t t0)
+{
+    __atomic_store_n(waits, *waits + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(waitNs, *waitNs + (qclock() - t0), __ATOMIC_RELAXED);
+}
+
+// The queue's state, as seen from another thread without the lock.
+// Each field is read as a whole, though not at the same instant.
+struct qsnap {
+    int nq, nblob, nidle, nthreads;
+    size_t blobBytes;
+    uint64_t produceWaits, produceWaitNs;
+    uint64_t consumeWaits, consumeWaitNs;
+};
+
+static inline void snapshot(struct queue *Q, struct qsnap *s)
+{
+    s->nq = __atomic_load_n(&Q->nq, __ATOMIC_RELAXED);
+    s->nblob = __atomic_load_n(&Q->nblob, __ATOMIC_RELAXED);
+    s->nidle = __atomic_load_n(&Q->nidle, __ATOMIC_RELAXED);
+    s->nthreads = __atomic_load_n(&Q->nthreads, __ATOMIC_RELAXED);
+    s->blobBytes = __atomic_load_n(&Q->blobBytes, __ATOMIC_RELAXED);
+    s->produceWaits = __atomic_load_n(&Q->produceWaits, __ATOMIC_RELAXED);
+    s->produceWaitNs = __atomic_load_n(&Q->produceWaitNs, __ATOMIC_RELAXED);
+    s->consumeWaits = __atomic_load_n(&Q->consumeWaits, __ATOMIC_RELAXED);
+    s->consumeWaitNs = __atomic_load_n(&Q->consumeWaitNs, __ATOMIC_RELAXED);
+}
+
+// Search a blob in Q->q starting with qe.
+static inline struct qent *findBlob(struct qent *qe)
+{
+    // Cf. Quicker sequential search in [Knuth, Vol.3, p.398].
+    while (1) {
+	if (qe[0].stage == STAGE_BLOB) break;
+	if (qe[1].stage == STAGE_BLOB) { qe += 1; break; }
+	if (qe[2].stage == STAGE_BLOB) { qe += 2; break; }
+	if (qe[3].stage == STAGE_BLOB) { qe += 3; break; }
+	qe += 4;
+    }
+    return qe;
+}
+
+// Pass the string to the sink, unless the queue is stopped.
+static inline void sink(struct queue *Q, char *str, size_t len)
+{
+    if (Q->stopped)
+	free(str);
+    else if (Q->sink(Q->sinkArg, str, len)) {
+	Q->stopped = true;
+	if (!Q->err[0])
+	    Q->err[0] = "sink", Q->err[1] = "stopped";
+    }
+}
+
+// A failed job stops the queue, but its entry still has to go through
+// the queue, so it is put back as an empty string.
+static inline char *failed(struct queue *Q, const char *err[2], size_t *lenp)
+{
+    if (!Q->stopped) {
+	Q->stopped = true;
+	Q->err[0] = err[0], Q->err[1] = err[1];
+    }
+    char *str = malloc(1);
+    if (!str) die("%s: %m", "malloc");
+    *lenp = 0;
+    return str;
+}
+
+// After formatting is done, put the string back and flush the queue,
+// picking up earlier strings and passing them to the sink in the
+// original order.
+static void putBack(struct queue *Q, uintptr_t cookie, char *str, size_t len)
+{
+    int i;
+    // Flush the queue.
+    for (i = 0; i < Q->nq; i++) {
+	struct qent *qe = &Q->q[i];
+	if (qe->stage == STAGE_STR)
+	    sink(Q, qe->str, qe->len);
+	else if (qe->cookie == cookie) {
+	    sink(Q, str, len);
+	    str = NULL;
+	}
+	else
+	    break;
+    }
+    // Advance the queue.
+    Q->nq -= i;
+    memmove(Q->q, Q->q + i, Q->nq * sizeof(struct qent));
+    // Was it put back?
+    if (str == NULL)
+	return;
+    // Still need to put back.
+    struct qent *qe = Q->q + 1;
+    while (1) {
+	if (qe[0].cookie == cookie) break;
+	if (qe[1].cookie == cookie) { qe += 1; break; }
+	if (qe[2].cookie == cookie) { qe += 2; break; }
+	if (qe[3].cookie == cookie) { qe += 3; break; }
+	qe += 4;
+    }
+    qe->str = str;
+    assert(len < ~0U);
+    qe->len = len;
+    qe->stage = STAGE_STR;
+}
+
+// This routine is executed by the worker threads.
+static void *worker(void *arg)
+{
+    struct queue *Q = arg;
+    struct qprog *prog = &Q->prog[__atomic_fetch_add(&Q->nprog, 1, __ATOMIC_RELAXED)];
+    uintptr_t cookie = 0;
+    char *str = NULL;
+    size_t len = 0;
+    const char *jerr[2];
+    while (1) {
+	// Lock the mutex.
+	int err = pthread_mutex_lock(&Q->mutex);
+	if (err) die("%s: %s", "pthread_mutex_lock", xstrerror(err));
+	// See if they're possibly waiting to produce.
+	bool waiting = Q->nq == NQ;
+	// Put back the job from the previous iteration.
+	if (cookie) {
+	    if (!str)
+		str = failed(Q, jerr, &len);
+	    putBack(Q, cookie, str, len);
+	    cookie = 0, str = NULL, len = 0;
+	}
+	// If they're possibly waiting to produce, let them know.
+	if (waiting && Q->nq < NQ) {
+	    err = pthread_cond_signal(&Q->can_produce);
+	    if (err) die("%s: %s", "pthread_cond_signal", xstrerror(err));
+	}
+	// Try to fetch a blob from the queue.
+	void *blob;
+	unsigned blobSize;
+	while (1) {
+	    if (Q->nblob) {
+		struct qent *qe = findBlob(Q->q);
+		blob = qe->blob;
+		// The sentinel is left in place for the other workers.
+		if (blob == NULL)
+		    break;
+		blobSize = qe->blobSize;
+		// Make an odd cookie so that it never equals
+		// an aligned pointer such as malloc'd blob or str.
+		cookie = qe->cookie = (Q->seq++, Q->seq++);
+		qe->stage = STAGE_COOKING;
+		Q->nblob--, Q->blobBytes -= blobSize;
+		break;
+	    }
+	    // Wait until something is queued.
+	    Q->nidle++;
+	    uint64_t t0 = qclock();
+	    err = pthread_cond_wait(&Q->can_consume, &Q->mutex);
+	    if (err) die("%s: %s", "pthread_cond_wait", xstrerror(err));
+	    waited(&Q->consumeWaits, &Q->consumeWaitNs, t0);
+	    Q->nidle--;
+	}
+	// Got a blob, unlock the mutex.
+	err = pthread_mutex_unlock(&Q->mutex);
+	if (err) die("%s: %s", "pthread_mutex_unlock", xstrerror(err));
+	if (Q->drain)
+	    Q->drain(Q->sinkArg);
+	// Handle the end of the queue.
+	if (blob == NULL)
+	    return NULL;
+	// Do the job.
+	progBegin(prog);
+	str = Q->job(blob, blobSize, Q->jobArg, &len, jerr);
+	progEnd(prog, blobSize);
+    }
+}
+
+// Check if the worker needs aid from the main thread.
+static struct qent *needAid1(struct queue *Q)
+{
+    if (Q->nblob < 1)
+	return NULL;
+    return findBlob(Q->q);
+}
+
+// If there are at least two blobs, returns the first one.
+static struct qent *needAid2(struct queue *Q)
+{
+    if (Q->nblob < 2)
+	return NULL;
+    return findBlob(Q->q);
+}
+
+// If the number of blobs in the queue is roughly below this size,
+// the main thread will keep pumping up the queue with new blobs.
+// Otherwise, the main thread will also consider the possibility of
+// helping the worker thread to cope with the already loaded blobs.
+#define MINBLOB 16
+// Also, because decompressors operate in chunks, the total byte count
+// shouldn't drop much below the chunk size.
+#define MINBYTES (128<<10)
+
+static_assert(MINBLOB >= 4, "MINBLOB is not too small");
+static_assert(NQ >= 2 * MINBLOB, "NQ is not too small");
+
+// An advanced strategy for the main thread.
+static struct qent *needMoreAid(struct queue *Q)
+{
+    // Too few bytes left?  Time to recharge the decompressor.
+    if (Q->blobBytes < MINBYTES)
+	return NULL;
+    // Too few blobs?
+    if (Q->nblob < MINBLOB * 3 / 4)
+	return NULL;
+    struct qent *qe = findBlob(Q->q);
+    // The blob shouldn't be too big, as compared to other blobs.
+    // But note that we're averaging over MINBLOB, not Q->nblob.
+    // This means that, if the blob seems too big for now, it might
+    // be taken next time, after the main thread pushes another blob.
+    if (qe->blobSize > Q->blobBytes / MINBLOB)
+	return NULL;
+    return qe;
+}
+
+// The main thread then can help the worker.
+static void aid(struct queue *Q, struct qent *qe)
+{
+    void *blob = qe->blob;
+    unsigned blobSize = qe->blobSize;
+    // We're under the same lock as needAid(),
+    // complete the transition to the cooking stage.
+    uintptr_t cookie = qe->cookie = (Q->seq++, Q->seq++);
+    qe->stage = STAGE_COOKING;
+    Q->nblob--, Q->blobBytes -= blobSize;
+    // Unlock the mutex.
+    int err = pthread_mutex_unlock(&Q->mutex);
+    if (err) die("%s: %s", "pthread_mutex_unlock", xstrerror(err));
+    if (Q->drain)
+	Q->drain(Q->sinkArg);
+    // Do the job.
+    size_t len;
+    const char *jerr[2];
+    progBegin(&Q->prog[MAXTHREADS]);
+    char *str = Q->job(blob, blobSize, Q->jobArg, &len, jerr);
+    progEnd(&Q->prog[MAXTHREADS], blobSize);
+    // Lock the mutex.
+    err = pthread_mutex_lock(&Q->mutex);
+    if (err) die("%s: %s", "pthread_mutex_lock", xstrerror(err));
+    // Put back.
+    if (!str)
+	str = failed(Q, jerr, &len);
+    putBack(Q, cookie, str, len);
+}
+
+// Dispatch the blob, called from the main thread.  Returns false
+// if the queue has been stopped, the blob then stays with the caller.
+static bool processBlob(struct queue *Q, void *blob, unsigned blobSize)
+{
+    // Lock the mutex.
+    int err = pthread_mutex_lock(&Q->mutex);
+    if (err) die("%s: %s", "pthread_mutex_lock", xstrerror(err));
+    // Try to help while the queue is full.  But we also need
+    // to keep the worker busy while decoding the next blob,
+    // so don't grab the very last one.
+    while (Q->nq == NQ) {
+	struct qent *qe = needAid2(Q);
+	if (qe) {
+	    aid(Q, qe);
+	    continue;
+	}
+	// Wait until the queue is flushed.
+	uint64_t t0 = qclock();
+	err = pthread_cond_wait(&Q->can_produce, &Q->mutex);
+	if (err) die("%s: %s", "pthread_cond_wait", xstrerror(err));
+	waited(&Q->produceWaits, &Q->produceWaitNs, t0);
+    }
+    // No point in going on.
+    if (Q->stopped) {
+	err = pthread_mutex_unlock(&Q->mutex);
+	if (err) die("%s: %s", "pthread_mutex_unlock", xstrerror(err));
+	if (Q->drain)
+	    Q->drain(Q->sinkArg);
+	return false;
+    }
+    // Put the blob to the queue.
+    Q->q[Q->nq++] = (struct qent) { { blob }, { blobSize }, STAGE_BLOB };
+    Q->nblob++, Q->blobBytes += blobSize;
+    // If they're possibly waiting to consume, let them know.
+    if (Q->nidle) {
+	err = pthread_cond_signal(&Q->can_consume);
+	if (err) die("%s: %s", "pthread_cond_signal", xstrerror(err));
+    }
+    // See if more help is desirable.
+    while (1) {
+	struct qent *qe = needMoreAid(Q);
+	if (!qe)
+	    break;
+	aid(Q, qe);
+    }
+    // Unlock the mutex.
+    err = pthread_mutex_unlock(&Q->mutex);
+    if (err) die("%s: %s", "pthread_mutex_unlock", xstrerror(err));
+    if (Q->drain)
+	Q->drain(Q->sinkArg);
+    return true;
+}
+
+// Set up the queue and start the worker threads.
+static void start(struct queue *Q, int nthreads, jobFunc job, void *jobArg,
+		  sinkFunc sink, drainFunc drain, void *sinkArg)
+{
+    assert(nthreads > 0 && nthreads <= MAXTHREADS);
+    memset(Q, 0, offsetof(struct queue, q));
+    int err = pthread_mutex_init(&Q->mutex, NULL);
+    if (err) die("%s: %s", "pthread_mutex_init", xstrerror(err));
+    err = pthread_cond_init(&Q->can_produce, NULL);
+    if (err) die("%s: %s", "pthread_cond_init", xstrerror(err));
+    err = pthread_cond_init(&Q->can_consume, NULL);
+    if (err) die("%s: %s", "pthread_cond_init", xstrerror(err));
+    Q->job = job, Q->jobArg = jobArg;
+    Q->sink = sink, Q->drain = drain, Q->sinkArg = sinkArg;
+    for (Q->nthreads = 0; Q->nthreads < nthreads; Q->nthreads++) {
+	err = pthread_create(&Q->thread[Q->nthreads], NULL, worker, Q);
+	if (err) die("%s: %s", "pthread_create", xstrerror(err));
+    }
+}
+
+// Drain the queue, join the worker threads, and release the resources.
+// Returns false if the queue has been stopped, see Q->err.
+static bool finish(struct queue *Q)
+{
+    // Lock the mutex.
+    int err = pthread_mutex_lock(&Q->mutex);
+    if (err) die("%s: %s", "pthread_mutex_lock", xstrerror(err));
+    // Help as much as possible.
+    while (1) {
+	struct qent *qe = needAid1(Q);
+	if (qe)
+	    aid(Q, qe);
+	else
+	    break;
+    }
+    // Still need to wait if the queue is full.
+    while (Q->nq == NQ) {
+	uint64_t t0 = qclock();
+	err = pthread_cond_wait(&Q->can_produce, &Q->mutex);
+	if (err) die("%s: %s", "pthread_cond_wait", xstrerror(err));
+	waited(&Q->produceWaits, &Q->produceWaitNs, t0);
+    }
+    // Put the sentinel.
+    Q->q[Q->nq++] = (struct qent) { { NULL }, { 0 }, STAGE_BLOB };
+    Q->nblob++;
+    // Let them all know.
+    err = pthread_cond_broadcast(&Q->can_consume);
+    if (err) die("%s: %s", "pthread_cond_broadcast", xstrerror(err));
+    // Unlock the mutex.
+    err = pthread_mutex_unlock(&Q->mutex);
+    if (err) die("%s: %s", "pthread_mutex_unlock", xstrerror(err));
+    if (Q->drain)
+	Q->drain(Q->sinkArg);
+    // Join the worker threads.
+    for (int i = 0; i < Q->nthreads; i++) {
+	err = pthread_join(Q->thread[i], NULL);
+	if (err) die("%s: %s", "pthread_join", xstrerror(err));
+    }
+    // Verify the bookkeeping: only the sentinel must be left.
+    assert(Q->nq == 1), assert(Q->nblob == 1), assert(Q->blobBytes == 0);
+    Q->nq = Q->nblob = Q->nthreads = 0;
+    pthread_cond_destroy(&Q->can_consume);
+    pthread_cond_destroy(&Q->can_produce);
+    pthread_mutex_destroy(&Q->mutex);
+    return !Q->stopped;
+}
+
+// ex:set ts=8 sts=4 sw=4 noet:
@@ -0,0 +1,197 @@
+// Copyright (c) 2017 Alexey Tourbin
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// A repository loaded into memory: the header blobs, as they come out
+// of zpkglist, each in its own malloc'd block, and an index by the name,
+// which is built on the first lookup.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <rpm/rpmlib.h>
+#include <zpkglist.h>
+#include "pkglistquery.h"
+#include "hdrblob.h"
+#include "xstrerror.h"
+
+struct named {
+    const char *name;
+    size_t i;
+};
+
+struct pkglistRepo {
+    size_t n, alloc;
+    void **blobs;
+    unsigned *sizes;
+    size_t bytes;
+    // The index, for the first nindexed headers: the ordinals, sorted
+    // by the name, and the names in the same order.
+    size_t nindexed;
+    size_t *byName;
+    const char **names;
+};
+
+struct pkglistRepo *pkglistRepoNew(const char *err[2])
+{
+    struct pkglistRepo *r = calloc(1, sizeof *r);
+    if (!r) {
+	err[0] = "calloc", err[1] = xstrerror(ENOMEM);
+	return NULL;
+    }
+    return r;
+}
+
+void pkglistRepoFree(struct pkglistRepo *r)
+{
+    if (!r)
+	return;
+    for (size_t i = 0; i < r->n; i++)
+	free(r->blobs[i]);
+    free(r->blobs);
+    free(r->sizes);
+    free(r->byName);
+    free(r->names);
+    free(r);
+}
+
+static __thread char errbuf[256];
+
+ssize_t pkglistRepoAdd(struct pkglistRepo *r, int fd, const char *err[2])
+{
+    size_t n0 = r->n;
+    struct zpkglistReader *z;
+    const char *func = "zpkglistFdopen";
+    ssize_t ret = zpkglistFdopen(&z, fd, err);
+    if (ret > 0) {
+	void *blob;
+	func = "zpkglistNextMalloc";
+	while ((ret = zpkglistNextMalloc(z, &blob, NULL, false, err)) > 0) {
+	    if (!hdrblobCheck(blob, ret)) {
+		free(blob);
+		err[0] = "pkglistRepoAdd", err[1] = "bad header";
+		ret = -1, func = NULL;
+		break;
+	    }
+	    if (r->n == r->alloc) {
+		size_t alloc = r->alloc ? 2 * r->alloc : 1024;
+		void **blobs = realloc(r->blobs, alloc * sizeof *blobs);
+		if (blobs)
+		    r->blobs = blobs;
+		unsigned *sizes = blobs ? realloc(r->sizes, alloc * sizeof *sizes) : NULL;
+		if (!sizes) {
+		    free(blob);
+		    err[0] = "realloc", err[1] = xstrerror(ENOMEM);
+		    ret = -1, func = NULL;
+		    break;
+		}
+		r->sizes = sizes, r->alloc = alloc;
+	    }
+	    r->blobs[r->n] = blob;
+	    r->sizes[r->n++] = ret;
+	    r->bytes += ret;
+	}
+	zpkglistFree(z);
+    }
+    close(fd);
+    if (ret < 0) {
+	if (func && strcmp(func, err[0]) && strncmp(err[0], "zpkglist", 8)) {
+	    snprintf(errbuf, sizeof errbuf, "%s: %s", func, err[0]);
+	    err[0] = errbuf;
+	}
+	return -1;
+    }
+    return r->n - n0;
+}
+
+size_t pkglistRepoCount(struct pkglistRepo *r, size_t *bytesp)
+{
+    if (bytesp)
+	*bytesp = r->bytes;
+    return r->n;
+}
+
+const void *pkglistRepoBlob(struct pkglistRepo *r, size_t i, unsigned *sizep)
+{
+    *sizep = r->sizes[i];
+    return r->blobs[i];
+}
+
+// By the name, then in the original order.
+static int namedCmp(const void *a, const void *b)
+{
+    const struct named *x = a, *y = b;
+    int cmp = strcmp(x->name, y->name);
+    if (cmp)
+	return cmp;
+    return (x->i > y->i) - (x->i < y->i);
+}
+
+static bool buildIndex(struct pkglistRepo *r)
+{
+    struct named *ent = malloc(r->n * sizeof *ent + 1);
+    size_t *byName = malloc(r->n * sizeof *byName + 1);
+    const char **names = malloc(r->n * sizeof *names + 1);
+    if (!ent || !byName || !names) {
+	free(ent), free(byName), free(names);
+	return false;
+    }
+    for (size_t i = 0; i < r->n; i++) {
+	const char *name = hdrblobString(r->blobs[i], RPMTAG_NAME);
+	ent[i] = (struct named) { name ? name : "", i };
+    }
+    qsort(ent, r->n, sizeof *ent, namedCmp);
+    for (size_t i = 0; i < r->n; i++)
+	byName[i] = ent[i].i, names[i] = ent[i].name;
+    free(ent);
+    free(r->byName);
+    free(r->names);
+    r->byName = byName, r->names = names;
+    r->nindexed = r->n;
+    return true;
+}
+
+ssize_t pkglistRepoLookup(struct pkglistRepo *r, const char *name,
+	const size_t **idxp, const char *err[2])
+{
+    if (r->nindexed != r->n && !buildIndex(r)) {
+	err[0] = "malloc", err[1] = xstrerror(ENOMEM);
+	return -1;
+    }
+    // The first one not less than the name.
+    size_t lo = 0, hi = r->n;
+    while (lo < hi) {
+	size_t mid = lo + (hi - lo) / 2;
+	if (strcmp(r->names[mid], name) < 0)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    size_t end = lo;
+    while (end < r->n && strcmp(r->names[end], name) == 0)
+	end++;
+    *idxp = r->byName + lo;
+    return end - lo;
+}
+
+// ex:set ts=8 sts=4 sw=4 noet: